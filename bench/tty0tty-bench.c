@@ -0,0 +1,1067 @@
+/* ########################################################################
+
+   tty0tty - linux null modem emulator (benchmark)
+
+   ########################################################################
+
+   Measures throughput, round-trip latency and scaling over several pairs,
+   either on the ports of the kernel module (/dev/tntN) or on the pairs of
+   the pts daemon, which it starts itself. Every result is printed as one
+   JSON object per line on stdout, progress goes to stderr.
+
+   ########################################################################
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   ######################################################################## */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <linux/serial.h>
+
+#define BACKEND_TNT 0           /* /dev/tnt<2n> <=> /dev/tnt<2n+1> */
+#define BACKEND_PTS 1           /* pairs of a pts daemon started by us */
+
+#define MAX_LIST 32
+#define MAX_PAIRS 256
+#define MAX_ARGS 32
+#define DEV_NAME_MAX 64
+#define BUF_SIZE 65536
+#define PATTERN 251             /* period of the test data, a prime */
+#define SETTLE_MS 200           /* quiet time that ends a drain */
+#define LATENCY_TIMEOUT_MS 5000
+#define ACCURACY_MIN_BYTES 20   /* stretches runs at the slow rates */
+#define ACCURACY_MIN_SECS 0.5   /* and at the fast ones with a short -t */
+#define ACCURACY_RUNS 5         /* per setting, the median one counts */
+#define TURNAROUND_BYTES 20     /* sent before and during the turnaround */
+#define TURNAROUND_MS 100       /* delay_rts_after_send, the module's max */
+#define TURNAROUND_ROUNDS 10    /* of each variant, the worst one counts */
+
+struct pair
+{
+  char name[2][DEV_NAME_MAX];
+  int fd[2];
+};
+
+/* one throughput run over one pair */
+struct run
+{
+  struct pair *pair;
+  int baud;
+  size_t size;
+  size_t max_inflight;          /* written but not received, 0 no limit */
+  double secs;
+  unsigned long long bytes;     /* received within the window */
+  unsigned long long corrupt;   /* received bytes that broke the pattern */
+  double elapsed;
+  /* the first and the last read, which bound the time the line was busy */
+  unsigned long long first_ns, last_ns;
+  unsigned long long first_bytes;
+};
+
+static const struct
+{
+  int baud;
+  speed_t speed;
+} speeds[] =
+{
+  { 50, B50 }, { 75, B75 }, { 110, B110 }, { 134, B134 }, { 150, B150 },
+  { 200, B200 }, { 300, B300 }, { 600, B600 }, { 1200, B1200 },
+  { 1800, B1800 }, { 2400, B2400 }, { 4800, B4800 }, { 9600, B9600 },
+  { 19200, B19200 }, { 38400, B38400 }, { 57600, B57600 },
+  { 115200, B115200 }, { 230400, B230400 }, { 460800, B460800 },
+  { 500000, B500000 }, { 576000, B576000 }, { 921600, B921600 },
+  { 1000000, B1000000 }, { 1152000, B1152000 }, { 1500000, B1500000 },
+  { 2000000, B2000000 }, { 2500000, B2500000 }, { 3000000, B3000000 },
+  { 3500000, B3500000 }, { 4000000, B4000000 },
+};
+
+static int backend = BACKEND_TNT;
+static struct pair pairs[MAX_PAIRS];
+static int npairs;
+static pid_t daemon_pid = -1;
+static const char *daemon_path = "../pts/tty0tty";
+static const char *daemon_args[MAX_ARGS];
+static int ndaemon_args;
+
+static int sizes[MAX_LIST] = { 1, 16, 64, 256, 1024, 4096 };
+static int nsizes = 6;
+static int bauds[MAX_LIST] = { 9600, 115200, 921600 };
+static int nbauds = 3;
+static int bauds_set;           /* -r given, accuracy sweeps only those */
+static char formats[MAX_LIST][4];
+static int nformats;
+static double tolerance = 1.0;  /* accuracy: largest drift in percent */
+static double secs = 1.0;
+static int iterations = 1000;
+static int max_pairs = 4;
+
+static unsigned long long
+now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static const char *
+backend_name(void)
+{
+  return backend == BACKEND_PTS ? "pts" : "tnt";
+}
+
+static int
+parse_list(const char *arg, int *list)
+{
+  char *copy, *tok, *save;
+  int n = 0;
+
+  copy = strdup(arg);
+  if (copy == NULL)
+    return -1;
+  for (tok = strtok_r(copy, ",", &save); tok != NULL;
+       tok = strtok_r(NULL, ",", &save))
+  {
+    if (n == MAX_LIST || atoi(tok) <= 0)
+    {
+      free(copy);
+      return -1;
+    }
+    list[n++] = atoi(tok);
+  }
+  free(copy);
+  return n;
+}
+
+/* "8N1" and the like into the c_cflag bits for it, -1 if invalid */
+static int
+parse_format(const char *format)
+{
+  static const tcflag_t csize[] = { CS5, CS6, CS7, CS8 };
+  int cflag;
+
+  if (strlen(format) != 3 || format[0] < '5' || format[0] > '8')
+    return -1;
+  cflag = csize[format[0] - '5'];
+
+  switch (format[1])
+  {
+  case 'N':
+    break;
+  case 'E':
+    cflag |= PARENB;
+    break;
+  case 'O':
+    cflag |= PARENB | PARODD;
+    break;
+  default:
+    return -1;
+  }
+
+  switch (format[2])
+  {
+  case '1':
+    break;
+  case '2':
+    cflag |= CSTOPB;
+    break;
+  default:
+    return -1;
+  }
+  return cflag;
+}
+
+/* bits one byte takes on the wire: start, data, parity and stop bits */
+static int
+format_bits(const char *format)
+{
+  return 1 + (format[0] - '0') + (format[1] != 'N') + (format[2] - '0');
+}
+
+static int
+parse_formats(const char *arg)
+{
+  char *copy, *tok, *save;
+  int n = 0;
+
+  copy = strdup(arg);
+  if (copy == NULL)
+    return -1;
+  for (tok = strtok_r(copy, ",", &save); tok != NULL;
+       tok = strtok_r(NULL, ",", &save))
+  {
+    if (n == MAX_LIST || parse_format(tok) < 0)
+    {
+      free(copy);
+      return -1;
+    }
+    strcpy(formats[n++], tok);
+  }
+  free(copy);
+  return n;
+}
+
+/* every data bits, parity and stop bits combination the backend has:
+ * ptys always use 8 data bits without parity, only the stop bits are
+ * kept */
+static void
+all_formats(void)
+{
+  const char *parity = backend == BACKEND_PTS ? "N" : "NEO";
+  int data, p, stop;
+
+  nformats = 0;
+  for (data = backend == BACKEND_PTS ? '8' : '5'; data <= '8'; data++)
+    for (p = 0; parity[p]; p++)
+      for (stop = '1'; stop <= '2'; stop++)
+      {
+        formats[nformats][0] = data;
+        formats[nformats][1] = parity[p];
+        formats[nformats][2] = stop;
+        formats[nformats][3] = '\0';
+        nformats++;
+      }
+}
+
+static int
+set_line(int fd, int baud, const char *format)
+{
+  struct termios params;
+  unsigned int i;
+
+  for (i = 0; i < sizeof(speeds) / sizeof(speeds[0]); i++)
+    if (speeds[i].baud == baud)
+      break;
+  if (i == sizeof(speeds) / sizeof(speeds[0]))
+  {
+    fprintf(stderr, "unsupported baud rate %d\n", baud);
+    return -1;
+  }
+
+  if (tcgetattr(fd, &params) < 0)
+  {
+    perror("tcgetattr");
+    return -1;
+  }
+  /* raw, no flow control: what the line rate is computed for */
+  cfmakeraw(&params);
+  params.c_cflag &= ~(CRTSCTS | CSIZE | CSTOPB | PARENB | PARODD);
+  params.c_cflag |= CLOCAL | CREAD | parse_format(format);
+  params.c_cc[VMIN] = 0;
+  params.c_cc[VTIME] = 0;
+  cfsetispeed(&params, speeds[i].speed);
+  cfsetospeed(&params, speeds[i].speed);
+  /* glibc fails with EINVAL if the tty did not take the frame format */
+  if (tcsetattr(fd, TCSANOW, &params) < 0)
+  {
+    fprintf(stderr, "tcsetattr %d baud %s: %s\n", baud, format,
+            strerror(errno));
+    return -1;
+  }
+  tcflush(fd, TCIOFLUSH);
+  return 0;
+}
+
+static int
+pair_open(struct pair *pair)
+{
+  int i;
+
+  for (i = 0; i < 2; i++)
+  {
+    pair->fd[i] = open(pair->name[i], O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (pair->fd[i] < 0)
+    {
+      perror(pair->name[i]);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* start the pts daemon and learn the names of its pairs from what it
+ * prints, "(/dev/pts/1) <=> (/dev/pts/2)" per pair */
+static int
+daemon_start(int count)
+{
+  const char *argv[MAX_ARGS + 4];
+  char line[2 * DEV_NAME_MAX + 16];
+  char num[16];
+  int out[2];
+  FILE *f;
+  int argc = 0;
+  int i;
+
+  if (pipe(out) < 0)
+  {
+    perror("pipe");
+    return -1;
+  }
+
+  snprintf(num, sizeof(num), "%d", count);
+  argv[argc++] = daemon_path;
+  for (i = 0; i < ndaemon_args; i++)
+    argv[argc++] = daemon_args[i];
+  argv[argc++] = "-n";
+  argv[argc++] = num;
+  argv[argc] = NULL;
+
+  daemon_pid = fork();
+  if (daemon_pid < 0)
+  {
+    perror("fork");
+    return -1;
+  }
+  if (daemon_pid == 0)
+  {
+    dup2(out[1], STDOUT_FILENO);
+    close(out[0]);
+    close(out[1]);
+    execv(daemon_path, (char * const *) argv);
+    perror(daemon_path);
+    _exit(127);
+  }
+  close(out[1]);
+
+  f = fdopen(out[0], "r");
+  if (f == NULL)
+  {
+    perror("fdopen");
+    return -1;
+  }
+  while (npairs < count && fgets(line, sizeof(line), f) != NULL)
+  {
+    struct pair *pair = &pairs[npairs];
+
+    if (sscanf(line, "(%63[^)]) <=> (%63[^)])",
+               pair->name[0], pair->name[1]) == 2)
+      npairs++;
+  }
+  /* the daemon keeps running with its stdout going nowhere */
+  fclose(f);
+
+  if (npairs < count)
+  {
+    fprintf(stderr, "%s announced %d of %d pairs\n", daemon_path, npairs,
+            count);
+    return -1;
+  }
+  return 0;
+}
+
+static void
+daemon_stop(void)
+{
+  if (daemon_pid <= 0)
+    return;
+  kill(daemon_pid, SIGTERM);
+  waitpid(daemon_pid, NULL, 0);
+  daemon_pid = -1;
+}
+
+static int
+pairs_setup(int count)
+{
+  int i;
+
+  if (backend == BACKEND_PTS)
+  {
+    if (daemon_start(count) < 0)
+      return -1;
+  }
+  else
+  {
+    for (i = 0; i < count; i++)
+    {
+      snprintf(pairs[i].name[0], DEV_NAME_MAX, "/dev/tnt%d", 2 * i);
+      snprintf(pairs[i].name[1], DEV_NAME_MAX, "/dev/tnt%d", 2 * i + 1);
+    }
+    npairs = count;
+  }
+
+  for (i = 0; i < npairs; i++)
+    if (pair_open(&pairs[i]) < 0)
+      return -1;
+  return 0;
+}
+
+/* read whatever is left over from an earlier run, until nothing came
+ * for SETTLE_MS plus a few byte times */
+static void
+drain(int fd, int baud)
+{
+  char buf[4096];
+  struct pollfd pfd = { fd, POLLIN, 0 };
+  int quiet = SETTLE_MS + 3 * 12 * 1000 / baud;
+
+  while (poll(&pfd, 1, quiet) > 0 && read(fd, buf, sizeof(buf)) > 0)
+    ;
+}
+
+/* Send from port 0 to port 1 for run->secs seconds, writing run->size
+ * bytes at a time, and count what arrives in that window. */
+static void *
+throughput_run(void *arg)
+{
+  struct run *run = arg;
+  struct pair *pair = run->pair;
+  struct pollfd pfd[2];
+  static __thread char wbuf[BUF_SIZE], rbuf[BUF_SIZE];
+  unsigned long long start, end, now;
+  size_t woff = 0, roff = 0;
+  size_t len;
+  ssize_t n, i;
+
+  run->bytes = run->corrupt = 0;
+  run->first_ns = run->last_ns = run->first_bytes = 0;
+  for (i = 0; i < BUF_SIZE; i++)
+    wbuf[i] = i % PATTERN;
+
+  drain(pair->fd[1], run->baud);
+  start = now_ns();
+  end = start + (unsigned long long) (run->secs * 1e9);
+
+  pfd[0].fd = pair->fd[0];
+  pfd[0].events = POLLOUT;
+  pfd[1].fd = pair->fd[1];
+  pfd[1].events = POLLIN;
+  for (now = start; now < end; now = now_ns())
+  {
+    len = run->size;
+    if (run->max_inflight && len > run->max_inflight - (woff - roff))
+      len = run->max_inflight - (woff - roff);
+    pfd[0].events = len ? POLLOUT : 0;
+    if (poll(pfd, 2, (end - now) / 1000000 + 1) < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      perror("poll");
+      break;
+    }
+    if (pfd[0].revents & POLLOUT)
+    {
+      /* the pattern continues across writes, see woff */
+      n = write(pair->fd[0], wbuf + woff % PATTERN, len);
+      if (n > 0)
+        woff += n;
+    }
+    if (pfd[1].revents & POLLIN)
+    {
+      n = read(pair->fd[1], rbuf, sizeof(rbuf));
+      for (i = 0; i < n; i++, roff++)
+        if ((unsigned char) rbuf[i] != roff % PATTERN)
+          run->corrupt++;
+      if (n > 0)
+      {
+        run->bytes += n;
+        run->last_ns = now_ns();
+        if (!run->first_ns)
+        {
+          run->first_ns = run->last_ns;
+          run->first_bytes = n;
+        }
+      }
+    }
+  }
+  run->elapsed = (now - start) / 1e9;
+
+  /* what was still queued must not leak into the next run */
+  tcflush(pair->fd[0], TCOFLUSH);
+  drain(pair->fd[1], run->baud);
+  return NULL;
+}
+
+static void
+print_throughput(const char *test, int npairs_run, struct run *run,
+                 unsigned long long bytes, double elapsed,
+                 unsigned long long corrupt)
+{
+  printf("{\"test\":\"%s\",\"backend\":\"%s\",\"pairs\":%d,\"baud\":%d,"
+         "\"size\":%zu,\"secs\":%.3f,\"bytes\":%llu,\"bytes_per_sec\":%.0f,"
+         "\"line_bytes_per_sec\":%.0f,\"corrupt\":%llu}\n",
+         test, backend_name(), npairs_run, run->baud, run->size, elapsed,
+         bytes, bytes / elapsed, npairs_run * run->baud / 10.0, corrupt);
+  fflush(stdout);
+}
+
+static int
+bench_throughput(void)
+{
+  struct run run;
+  int b, s;
+
+  for (b = 0; b < nbauds; b++)
+  {
+    if (set_line(pairs[0].fd[0], bauds[b], "8N1") < 0 ||
+        set_line(pairs[0].fd[1], bauds[b], "8N1") < 0)
+      return -1;
+    for (s = 0; s < nsizes; s++)
+    {
+      fprintf(stderr, "throughput: %d baud, %d byte writes\n", bauds[b],
+              sizes[s]);
+      run.pair = &pairs[0];
+      run.baud = bauds[b];
+      run.size = sizes[s];
+      run.max_inflight = 0;
+      run.secs = secs;
+      throughput_run(&run);
+      print_throughput("throughput", 1, &run, run.bytes, run.elapsed,
+                       run.corrupt);
+    }
+  }
+  return 0;
+}
+
+/* read exactly len bytes, waiting at most LATENCY_TIMEOUT_MS for each */
+static int
+read_full(int fd, char *buf, size_t len)
+{
+  struct pollfd pfd = { fd, POLLIN, 0 };
+  size_t got = 0;
+  ssize_t n;
+
+  while (got < len)
+  {
+    if (poll(&pfd, 1, LATENCY_TIMEOUT_MS) <= 0)
+      return -1;
+    n = read(fd, buf + got, len - got);
+    if (n < 0 && errno != EAGAIN)
+      return -1;
+    if (n > 0)
+      got += n;
+  }
+  return 0;
+}
+
+static int
+cmp_ull(const void *a, const void *b)
+{
+  unsigned long long x = *(const unsigned long long *) a;
+  unsigned long long y = *(const unsigned long long *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+/* Ping-pong: port 0 sends a message, port 1 echoes it back. The round
+ * trip includes both directions and the line time of the message twice. */
+static int
+bench_latency(void)
+{
+  struct pair *pair = &pairs[0];
+  unsigned long long *rtt, start, sum = 0;
+  char msg[BUF_SIZE], echo[BUF_SIZE];
+  int baud = bauds[nbauds - 1];
+  size_t size = sizes[0];
+  int i, done;
+
+  if (size > sizeof(msg))
+    size = sizeof(msg);
+  if (set_line(pair->fd[0], baud, "8N1") < 0 ||
+      set_line(pair->fd[1], baud, "8N1") < 0)
+    return -1;
+
+  rtt = calloc(iterations, sizeof(*rtt));
+  if (rtt == NULL)
+  {
+    perror("calloc");
+    return -1;
+  }
+  for (i = 0; i < (int) size; i++)
+    msg[i] = i % PATTERN;
+
+  fprintf(stderr, "latency: %d baud, %zu byte messages, %d round trips\n",
+          baud, size, iterations);
+  for (done = 0; done < iterations; done++)
+  {
+    start = now_ns();
+    if (write(pair->fd[0], msg, size) != (ssize_t) size ||
+        read_full(pair->fd[1], echo, size) < 0 ||
+        write(pair->fd[1], echo, size) != (ssize_t) size ||
+        read_full(pair->fd[0], echo, size) < 0)
+    {
+      fprintf(stderr, "latency: round trip %d failed\n", done);
+      break;
+    }
+    rtt[done] = now_ns() - start;
+    sum += rtt[done];
+  }
+
+  if (done > 0)
+  {
+    qsort(rtt, done, sizeof(*rtt), cmp_ull);
+    printf("{\"test\":\"latency\",\"backend\":\"%s\",\"baud\":%d,"
+           "\"size\":%zu,\"count\":%d,\"min_ns\":%llu,\"mean_ns\":%llu,"
+           "\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,"
+           "\"max_ns\":%llu}\n",
+           backend_name(), baud, size, done, rtt[0], sum / done,
+           rtt[done / 2], rtt[(int) (done * 0.99)],
+           rtt[(int) (done * 0.999)], rtt[done - 1]);
+    fflush(stdout);
+  }
+  free(rtt);
+  return done == iterations ? 0 : -1;
+}
+
+/* 1..max_pairs pairs sending at the same time, one thread each, at the
+ * highest baud rate and largest write size of the sweep */
+static int
+bench_scaling(void)
+{
+  pthread_t threads[MAX_PAIRS];
+  struct run runs[MAX_PAIRS];
+  unsigned long long bytes, corrupt;
+  double elapsed;
+  int baud = bauds[nbauds - 1];
+  int size = sizes[nsizes - 1];
+  int k, i;
+
+  for (i = 0; i < max_pairs; i++)
+    if (set_line(pairs[i].fd[0], baud, "8N1") < 0 ||
+        set_line(pairs[i].fd[1], baud, "8N1") < 0)
+      return -1;
+
+  for (k = 1; k <= max_pairs; k++)
+  {
+    fprintf(stderr, "scaling: %d pairs\n", k);
+    for (i = 0; i < k; i++)
+    {
+      runs[i].pair = &pairs[i];
+      runs[i].baud = baud;
+      runs[i].size = size;
+      runs[i].max_inflight = 0;
+      runs[i].secs = secs;
+      if (pthread_create(&threads[i], NULL, throughput_run, &runs[i]) != 0)
+      {
+        fprintf(stderr, "pthread_create failed\n");
+        return -1;
+      }
+    }
+    bytes = corrupt = 0;
+    elapsed = 0;
+    for (i = 0; i < k; i++)
+    {
+      pthread_join(threads[i], NULL);
+      bytes += runs[i].bytes;
+      corrupt += runs[i].corrupt;
+      if (runs[i].elapsed > elapsed)
+        elapsed = runs[i].elapsed;
+    }
+    print_throughput("scaling", k, &runs[0], bytes, elapsed, corrupt);
+  }
+  return 0;
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+  double x = *(const double *) a;
+  double y = *(const double *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+/* For every baud rate and frame format, how far the rate data arrives at
+ * is from the line rate. Only bytes after the first read count, over the
+ * time up to the last one, so neither the latency of the first byte nor
+ * the end of the window get in the way. Each setting is measured
+ * ACCURACY_RUNS times and the median drift is checked, so one window a
+ * busy machine did not schedule us in does not fail it. */
+static int
+bench_accuracy(void)
+{
+  struct pair *pair = &pairs[0];
+  const int *rates = bauds;
+  int nrates = nbauds;
+  int all_rates[sizeof(speeds) / sizeof(speeds[0])];
+  double expected, measured, drift[ACCURACY_RUNS];
+  unsigned long long bytes, corrupt;
+  double elapsed;
+  struct run run;
+  int failed = 0;
+  int b, f, r, bits, pass;
+
+  if (!bauds_set)
+  {
+    for (b = 0; b < (int) (sizeof(speeds) / sizeof(speeds[0])); b++)
+      all_rates[b] = speeds[b].baud;
+    rates = all_rates;
+    nrates = b;
+  }
+
+  for (b = 0; b < nrates; b++)
+    for (f = 0; f < nformats; f++)
+    {
+      if (set_line(pair->fd[0], rates[b], formats[f]) < 0 ||
+          set_line(pair->fd[1], rates[b], formats[f]) < 0)
+        return -1;
+      bits = format_bits(formats[f]);
+      expected = (double) rates[b] / bits;
+
+      fprintf(stderr, "accuracy: %d baud %s\n", rates[b], formats[f]);
+      run.pair = pair;
+      run.baud = rates[b];
+      run.size = sizes[nsizes - 1];
+      /* enough to keep the line busy without leaving much queued for
+       * the next run, which takes long to drain at the slow rates */
+      run.max_inflight = expected / 10 + 16;
+      run.secs = secs;
+      if (run.secs < ACCURACY_MIN_SECS)
+        run.secs = ACCURACY_MIN_SECS;
+      if (run.secs < (ACCURACY_MIN_BYTES + 1) / expected)
+        run.secs = (ACCURACY_MIN_BYTES + 1) / expected;
+
+      bytes = corrupt = 0;
+      elapsed = 0;
+      for (r = 0; r < ACCURACY_RUNS; r++)
+      {
+        throughput_run(&run);
+        bytes += run.bytes;
+        corrupt += run.corrupt;
+        elapsed += run.elapsed;
+        measured = 0;
+        if (run.last_ns > run.first_ns)
+          measured = (run.bytes - run.first_bytes) * 1e9 /
+                     (run.last_ns - run.first_ns);
+        drift[r] = (measured - expected) * 100 / expected;
+      }
+      qsort(drift, ACCURACY_RUNS, sizeof(drift[0]), cmp_double);
+      measured = expected * (1 + drift[ACCURACY_RUNS / 2] / 100);
+      pass = drift[ACCURACY_RUNS / 2] <= tolerance &&
+             drift[ACCURACY_RUNS / 2] >= -tolerance;
+      if (!pass)
+        failed++;
+
+      printf("{\"test\":\"accuracy\",\"backend\":\"%s\",\"baud\":%d,"
+             "\"format\":\"%s\",\"bits\":%d,\"runs\":%d,\"secs\":%.3f,"
+             "\"bytes\":%llu,\"bytes_per_sec\":%.3f,"
+             "\"line_bytes_per_sec\":%.3f,\"drift_pct\":%.4f,"
+             "\"drift_min_pct\":%.4f,\"drift_max_pct\":%.4f,"
+             "\"corrupt\":%llu,\"pass\":%s}\n",
+             backend_name(), rates[b], formats[f], bits, ACCURACY_RUNS,
+             elapsed, bytes, measured, expected, drift[ACCURACY_RUNS / 2],
+             drift[0], drift[ACCURACY_RUNS - 1], corrupt,
+             pass ? "true" : "false");
+      fflush(stdout);
+    }
+
+  if (failed)
+    fprintf(stderr, "accuracy: %d settings off by more than %g%%\n",
+            failed, tolerance);
+  return failed ? -1 : 0;
+}
+
+/* One round of the turnaround test: a first write, then a second one once
+ * the first has arrived or, with drained set, the moment the transmit fifo
+ * runs empty, which is when the module arms the turnaround. Returns how
+ * long the first byte of the second write took and how long the rest of
+ * it kept arriving. */
+static int
+turnaround_round(struct pair *pair, int drained, unsigned long long *first,
+                 unsigned long long *span)
+{
+  struct pollfd pfd = { pair->fd[1], POLLIN, 0 };
+  char buf[2 * TURNAROUND_BYTES];
+  unsigned long long start, deadline, last = 0;
+  int need = drained ? 2 * TURNAROUND_BYTES : TURNAROUND_BYTES;
+  int got = 0, queued;
+  ssize_t n;
+
+  memset(buf, 0x55, sizeof(buf));
+  if (write(pair->fd[0], buf, TURNAROUND_BYTES) != TURNAROUND_BYTES)
+    return -1;
+  if (drained)
+  {
+    deadline = now_ns() + LATENCY_TIMEOUT_MS * 1000000ULL;
+    do
+      if (ioctl(pair->fd[0], TIOCOUTQ, &queued) < 0 || now_ns() > deadline)
+        return -1;
+    while (queued > 0);
+  }
+  else if (read_full(pair->fd[1], buf, TURNAROUND_BYTES) < 0)
+  {
+    return -1;
+  }
+
+  /* RTS is up for another TURNAROUND_MS */
+  start = now_ns();
+  if (write(pair->fd[0], buf, TURNAROUND_BYTES) != TURNAROUND_BYTES)
+    return -1;
+  *first = 0;
+  while (got < need && poll(&pfd, 1, LATENCY_TIMEOUT_MS) > 0)
+  {
+    n = read(pair->fd[1], buf, need - got);
+    if (n <= 0)
+      continue;
+    got += n;
+    last = now_ns();
+    /* with drained set the tail of the first write comes before */
+    if (*first == 0 && got > need - TURNAROUND_BYTES)
+      *first = last;
+  }
+  if (got < need)
+  {
+    fprintf(stderr, "turnaround: %d of %d bytes arrived\n", got, need);
+    return -1;
+  }
+  *span = last - *first;
+  *first -= start;
+  return 0;
+}
+
+/* RS-485 on the module: data written while RTS is still up after the
+ * last transmission must go out at once, paced at the line rate, not wait
+ * for delay_rts_after_send and then arrive in one burst. */
+static int
+bench_turnaround(void)
+{
+  static const char *variants[] = { "received", "drained" };
+  struct pair *pair = &pairs[0];
+  struct serial_rs485 rs485;
+  unsigned long long first, span, worst, shortest, line;
+  int baud = bauds[0];
+  int failed = 0;
+  int v, r, pass;
+
+  if (set_line(pair->fd[0], baud, "8N1") < 0 ||
+      set_line(pair->fd[1], baud, "8N1") < 0)
+    return -1;
+
+  memset(&rs485, 0, sizeof(rs485));
+  rs485.flags = SER_RS485_ENABLED | SER_RS485_RTS_ON_SEND;
+  rs485.delay_rts_after_send = TURNAROUND_MS;
+  if (ioctl(pair->fd[0], TIOCSRS485, &rs485) < 0)
+  {
+    perror("TIOCSRS485");
+    return -1;
+  }
+
+  /* what the bytes after the first take on the wire, with some slack
+   * for the coalescing of the receiver */
+  line = (TURNAROUND_BYTES - 1) * 10 * 1000000000ULL / baud;
+  for (v = 0; v < 2; v++)
+  {
+    fprintf(stderr, "turnaround: %d baud, %d ms after send, second write "
+            "once %s\n", baud, TURNAROUND_MS, variants[v]);
+    worst = 0;
+    shortest = ~0ULL;
+    for (r = 0; r < TURNAROUND_ROUNDS; r++)
+    {
+      if (turnaround_round(pair, v, &first, &span) < 0)
+      {
+        fprintf(stderr, "turnaround: round %d failed\n", r);
+        failed++;
+        break;
+      }
+      if (first > worst)
+        worst = first;
+      if (span < shortest)
+        shortest = span;
+      /* back to idle, RTS dropped, before the next round */
+      usleep(2 * TURNAROUND_MS * 1000);
+    }
+    if (r < TURNAROUND_ROUNDS)
+      continue;
+
+    pass = worst < TURNAROUND_MS * 1000000ULL / 2 && shortest >= line * 8 / 10;
+    if (!pass)
+      failed++;
+    printf("{\"test\":\"turnaround\",\"backend\":\"%s\",\"baud\":%d,"
+           "\"variant\":\"%s\",\"rounds\":%d,\"bytes\":%d,"
+           "\"delay_ms\":%d,\"first_byte_ns\":%llu,\"span_ns\":%llu,"
+           "\"line_span_ns\":%llu,\"pass\":%s}\n",
+           backend_name(), baud, variants[v], TURNAROUND_ROUNDS,
+           TURNAROUND_BYTES, TURNAROUND_MS, worst, shortest, line,
+           pass ? "true" : "false");
+    fflush(stdout);
+  }
+
+  rs485.flags = 0;
+  ioctl(pair->fd[0], TIOCSRS485, &rs485);
+  return failed ? -1 : 0;
+}
+
+static void
+usage(const char *prog)
+{
+  fprintf(stderr,
+          "usage: %s [-b tnt|pts] [-s sizes] [-r rates] [-t secs] "
+          "[-i count] [-n pairs] [-f formats] [-e percent] [-P path] "
+          "[-A arg] [test ...]\n"
+          "  -b backend  ports of the kernel module (default) or of the pts "
+          "daemon\n"
+          "  -s sizes    write sizes to sweep, comma separated "
+          "(default 1,16,64,256,1024,4096)\n"
+          "  -r rates    baud rates to sweep (default 9600,115200,921600)\n"
+          "  -t secs     duration of each throughput run (default 1)\n"
+          "  -i count    round trips for the latency test (default 1000)\n"
+          "  -n pairs    largest number of pairs for scaling (default 4)\n"
+          "  -f formats  frame formats for accuracy, e.g. 8N1,7E2 "
+          "(default all, 8N1,8N2 on pts)\n"
+          "  -e percent  drift accuracy tolerates (default 1)\n"
+          "  -P path     pts daemon to start (default ../pts/tty0tty)\n"
+          "  -A arg      extra argument for the daemon, e.g. -A -p\n"
+          "tests: throughput latency scaling (default: these three), "
+          "accuracy and turnaround\n"
+          "Latency uses the first size and the last rate, scaling the last "
+          "of both.\nAccuracy checks every rate unless -r is given and needs "
+          "pacing (speedup=1 or -A -p).\nTurnaround checks RS-485 writes while "
+          "RTS is still up, at the first rate,\non the module with "
+          "speedup=1.\n",
+          prog);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int throughput = 0, latency = 0, scaling = 0, accuracy = 0;
+  int turnaround = 0;
+  int ret = 0;
+  int opt, i;
+
+  while ((opt = getopt(argc, argv, "b:s:r:t:i:n:f:e:P:A:h")) != -1)
+  {
+    switch (opt)
+    {
+    case 'b':
+      if (strcmp(optarg, "tnt") == 0)
+        backend = BACKEND_TNT;
+      else if (strcmp(optarg, "pts") == 0)
+        backend = BACKEND_PTS;
+      else
+      {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 's':
+      nsizes = parse_list(optarg, sizes);
+      break;
+    case 'r':
+      nbauds = parse_list(optarg, bauds);
+      bauds_set = 1;
+      break;
+    case 't':
+      secs = atof(optarg);
+      break;
+    case 'i':
+      iterations = atoi(optarg);
+      break;
+    case 'n':
+      max_pairs = atoi(optarg);
+      break;
+    case 'f':
+      nformats = parse_formats(optarg);
+      if (nformats == 0)
+        nformats = -1;
+      break;
+    case 'e':
+      tolerance = atof(optarg);
+      break;
+    case 'P':
+      daemon_path = optarg;
+      break;
+    case 'A':
+      if (ndaemon_args == MAX_ARGS)
+      {
+        usage(argv[0]);
+        return 1;
+      }
+      daemon_args[ndaemon_args++] = optarg;
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (nformats == 0)
+    all_formats();
+  if (nsizes <= 0 || nbauds <= 0 || nformats <= 0 || secs <= 0 ||
+      iterations <= 0 || tolerance < 0 ||
+      max_pairs <= 0 || max_pairs > MAX_PAIRS)
+  {
+    usage(argv[0]);
+    return 1;
+  }
+  for (i = 0; i < nsizes; i++)
+    if (sizes[i] > BUF_SIZE - PATTERN)
+    {
+      fprintf(stderr, "write sizes are limited to %d\n", BUF_SIZE - PATTERN);
+      return 1;
+    }
+
+  for (i = optind; i < argc; i++)
+  {
+    if (strcmp(argv[i], "throughput") == 0)
+      throughput = 1;
+    else if (strcmp(argv[i], "latency") == 0)
+      latency = 1;
+    else if (strcmp(argv[i], "scaling") == 0)
+      scaling = 1;
+    else if (strcmp(argv[i], "accuracy") == 0)
+      accuracy = 1;
+    else if (strcmp(argv[i], "turnaround") == 0)
+      turnaround = 1;
+    else
+    {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (!throughput && !latency && !scaling && !accuracy && !turnaround)
+    throughput = latency = scaling = 1;
+  if (turnaround && backend != BACKEND_TNT)
+  {
+    fprintf(stderr, "turnaround: RS-485 needs the module (-b tnt)\n");
+    return 1;
+  }
+
+  /* a port whose reader went away must not kill the benchmark */
+  signal(SIGPIPE, SIG_IGN);
+
+  if (pairs_setup(scaling ? max_pairs : 1) < 0)
+  {
+    daemon_stop();
+    return 1;
+  }
+
+  if (throughput && bench_throughput() < 0)
+    ret = 1;
+  if (latency && bench_latency() < 0)
+    ret = 1;
+  if (scaling && bench_scaling() < 0)
+    ret = 1;
+  if (accuracy && bench_accuracy() < 0)
+    ret = 1;
+  if (turnaround && bench_turnaround() < 0)
+    ret = 1;
+
+  for (i = 0; i < npairs; i++)
+  {
+    close(pairs[i].fd[0]);
+    close(pairs[i].fd[1]);
+  }
+  daemon_stop();
+  return ret;
+}
@@ -1,6 +1,6 @@
 /* ########################################################################
 
-   tty0tty - linux null modem emulator (module)  for kernel > 3.8
+   tty0tty - linux null modem emulator (module)  for kernel >= 4.16
 
    ########################################################################
 
@@ -37,12 +37,25 @@
 #include <linux/serial.h>
 #include <linux/sched.h>
 #include <linux/delay.h>
+#include <linux/kfifo.h>
+#include <linux/hrtimer.h>
+#include <linux/spinlock.h>
+#include <linux/device.h>
+#include <linux/miscdevice.h>
+#include <linux/mutex.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/atomic.h>
+#include <linux/rcupdate.h>
 #include <linux/version.h>
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
 #include <linux/sched/signal.h>
-#endif
 #include <asm/uaccess.h>
 
+#include "tty0tty.h"
+
+#define CREATE_TRACE_POINTS
+#include "tty0tty_trace.h"
+
 #define DRIVER_VERSION "v1.2"
 #define DRIVER_AUTHOR "Luis Claudio Gamboa Lopes <lcgamboa@yahoo.com>"
 #define DRIVER_DESC "tty0tty null modem driver"
@@ -61,7 +74,27 @@ MODULE_LICENSE("GPL");
 short pairs = 4;		//Default number of pairs of devices
 module_param(pairs, short, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
 MODULE_PARM_DESC(pairs,
-		 "Number of pairs of devices to be created, maximum of 128");
+		 "Number of pairs of devices to be created at load time");
+
+static int max_pairs = 1024;	//Pairs that can exist at the same time
+module_param(max_pairs, int, S_IRUGO);
+MODULE_PARM_DESC(max_pairs,
+		 "Maximum number of pairs, including the ones added at runtime");
+
+static unsigned int speedup = 1;	//Default baud rate emulation factor
+module_param(speedup, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(speedup,
+		 "Send N times faster than the baud rate, 0 disables pacing");
+
+static unsigned int coalesce_us = 100;	//Shortest interval between pushes
+module_param(coalesce_us, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(coalesce_us,
+		 "Deliver received data in batches at most this often (usecs)");
+
+static char *topology = "pair";	//Wiring of the ports created at load time
+module_param(topology, charp, S_IRUGO);
+MODULE_PARM_DESC(topology,
+		 "Wiring of the ports created at load time: pair, loop, broadcast or bus");
 
 #if 0
 #define TTY0TTY_MAJOR		240	/* experimental range */
@@ -82,14 +115,70 @@ MODULE_PARM_DESC(pairs,
 #define MSR_DSR		0x40
 #define MSR_RI		0x80
 
-static struct tty_port *tport;
+/* transmit fifo, like the xmit buffer of a real UART driver */
+#define TTY0TTY_XMIT_SIZE	PAGE_SIZE
+/* how long the last close waits for queued data to go out */
+#define TTY0TTY_CLOSING_WAIT	(30 * HZ)
+
+/* buckets of the write() blocking histogram, log2 of microseconds */
+#define TTY0TTY_HIST_BUCKETS	24
+
+/* receive FIFO of a 16550, see tty0tty_rx_fill() */
+#define TTY0TTY_FIFO_SIZE	16
+/* character times without new data before a partial FIFO is delivered */
+#define TTY0TTY_RX_TIMEOUT_CHARS	4
+
+/* longest RTS delay TIOCSRS485 takes, in ms, the same as serial_core */
+#define TTY0TTY_RS485_MAX_DELAY	100
+
+/* RS-485 direction control, see tty0tty_tx_timer() */
+enum {
+	TTY0TTY_RS485_IDLE,	/* receiving, RTS at its after-send level */
+	TTY0TTY_RS485_SETUP,	/* data queued, the timer enables the driver */
+	TTY0TTY_RS485_SEND,	/* driving the line */
+	TTY0TTY_RS485_TURNAROUND,	/* sent, RTS goes back after the delay */
+};
+
+/* largest number of pairs max_pairs can ask for */
+#define TTY0TTY_PAIRS_LIMIT	65536
+
+/* counters shown in debugfs, updated without taking any port lock */
+struct tty0tty_stats {
+	atomic64_t tx_bytes;	/* handed to the peer, or lost with no peer */
+	atomic64_t rx_bytes;	/* accepted into our flip buffer */
+	atomic64_t writes;	/* write() calls */
+	atomic64_t short_inserts;	/* flip buffer took less than offered */
+	atomic64_t pace_ns;	/* time spent sending at the paced rate */
+	atomic64_t line_ns;	/* the same at the real baud rate */
+	atomic64_t blocked[TTY0TTY_HIST_BUCKETS];	/* fifo full periods */
+};
+
+/* The ports a transmitter is wired to. Ports wired the same way share a
+ * list, and skip themselves in it unless it is their loop list. Removing a
+ * port clears its entries in place; readers hold rcu_read_lock(). */
+struct tty0tty_links {
+	struct rcu_head rcu;
+	unsigned int users;	/* ports using it, under tty0tty_table_lock */
+	int dirty;		/* an entry was cleared, see tty0tty_unlink() */
+	unsigned int count;
+	struct tty0tty_serial __rcu *port[];
+};
 
 struct tty0tty_serial {
+	struct tty_port port;	/* refcounts this structure */
+	int index;		/* minor number of this port */
 	struct tty_struct *tty;	/* pointer to the tty for this device */
 	int open_count;		/* number of times this port has been opened */
-	struct semaphore sem;	/* locks this structure */
 
-	/* for tiocmget and tiocmset functions */
+	/* the other ends of the cable, see tty0tty_links() */
+	struct tty0tty_links __rcu *links;
+	struct tty0tty_links *loop;	/* just this port */
+
+	/* For tiocmget and tiocmset functions. A port changes its own mcr
+	 * and msr, and the modem line counters of icount, only under its
+	 * own mctrl_lock; line changes are rare, the data path never takes
+	 * it. */
+	spinlock_t mctrl_lock;
 	int msr;		/* MSR shadow */
 	int mcr;		/* MCR shadow */
 
@@ -99,111 +188,896 @@ struct tty0tty_serial {
 	struct async_icount icount;
 
 	/* for timing control */
-	u64 nanosecs_per_byte;
+	u64 nanosecs_per_byte;	/* line time of a byte at the set baud rate */
+	u64 tx_ns_per_byte;	/* the same after speedup, 0 if not paced */
+
+	/* transmit path: write() queues into xmit_fifo and tx_timer moves
+	 * the bytes to the peer as fast as the line would carry them */
+	spinlock_t lock;	/* protects xmit_fifo and the tx state */
+	struct kfifo xmit_fifo;
+	struct hrtimer tx_timer;
+	u64 tx_last;		/* line time accounted for up to here */
+	int tx_running;		/* tx_timer is armed */
+	int tx_rearm;		/* data came while the callback ran unlocked */
+
+	/* receive side: the line discipline asked us to stop sending */
+	int throttled;
+
+	/* transmit side stopped by XOFF or by the line discipline, only
+	 * changed under lock, see tty0tty_set_stopped() */
+	int stopped;
+
+	/* Receive side. Senders feed our flip buffer under rx_lock, nested
+	 * inside their own lock; the error injector marks one in every
+	 * parity_errors or frame_errors bytes, the *_left ones count down
+	 * to the next. */
+	spinlock_t rx_lock;
+	unsigned int parity_errors;
+	unsigned int parity_left;
+	unsigned int frame_errors;
+	unsigned int frame_left;
+	int rx_flow;		/* last XOFF (-1) or XON (1) not acted on yet */
+
+	/* Bytes in the flip buffer the line discipline was not told about,
+	 * like the ones in a UART receive FIFO below the trigger level. The
+	 * FIFO size is serial.xmit_fifo_size. */
+	unsigned int rx_trigger;
+	unsigned int rx_pending;
+	struct hrtimer rx_timer;
+
+	/* sending a break, the transmitter is held until it ends */
+	int break_on;
+	struct hrtimer break_timer;
+
+	/* half-duplex emulation, under lock */
+	struct serial_rs485 rs485;
+	int rs485_state;
+
+	/* termios flags the peer's transmit path acts on, copied by
+	 * set_termios so that it never has to look at our tty */
+	int crtscts;
+	int ixon;
+	int parenb;
+	unsigned char start_char;
+	unsigned char stop_char;
+
+	unsigned int speedup;	/* pacing factor, set through sysfs */
+
+	/* statistics */
+	struct tty0tty_stats stats;
+	u64 blocked_since;	/* write() found the fifo full, 0 if not */
+	unsigned int baud_rate;
+	unsigned int bits_per_byte;
+	struct dentry *debugfs;
 };
 
-static struct tty0tty_serial **tty0tty_table;	/* initially all NULL */
+/* Ports of the existing pairs, NULL where no pair was created. Both ports
+ * of a pair are added and removed together under tty0tty_table_lock, which
+ * also serializes changes to the wiring. */
+static struct tty0tty_serial **tty0tty_table;
+static DEFINE_MUTEX(tty0tty_table_lock);
+static struct tty_driver *tty0tty_tty_driver;
+static struct dentry *tty0tty_debugfs;
 
-static int tty0tty_open(struct tty_struct *tty, struct file *file)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,1,0)
+static void tty0tty_set_termios(struct tty_struct *tty,
+				const struct ktermios *old_termios);
+#else
+static void tty0tty_set_termios(struct tty_struct *tty,
+				struct ktermios *old_termios);
+#endif
+static int tty0tty_tiocmset(struct tty_struct *tty,
+			    unsigned int set, unsigned int clear);
+static void tty0tty_set_mcr(struct tty0tty_serial *tty0tty,
+			    unsigned int set, unsigned int clear);
+
+static const char *const tty0tty_topologies[] = {
+	[TTY0TTY_WIRE_PAIR] = "pair",
+	[TTY0TTY_WIRE_LOOP] = "loop",
+	[TTY0TTY_WIRE_BROADCAST] = "broadcast",
+	[TTY0TTY_WIRE_BUS] = "bus",
+};
+
+/* where received data goes: the flip buffer of the peer's tty_port */
+#define tty0tty_flip(peer)	(&(peer)->port)
+
+/* The ports what we send reaches: our own input with MCR_LOOP set, else
+ * the ports we are wired to. Call it under rcu_read_lock(): changing the
+ * wiring waits for an RCU grace period before old lists and removed ports
+ * go away. */
+static struct tty0tty_links *tty0tty_links(struct tty0tty_serial *tty0tty)
 {
-	struct tty0tty_serial *tty0tty;
-	int index;
+	if (READ_ONCE(tty0tty->mcr) & MCR_LOOP)
+		return tty0tty->loop;
+	return rcu_dereference(tty0tty->links);
+}
+
+/* Entry @i of a list of @tty0tty, if it is open and listening. */
+static struct tty0tty_serial *tty0tty_peer(struct tty0tty_serial *tty0tty,
+					   struct tty0tty_links *links,
+					   unsigned int i)
+{
+	struct tty0tty_serial *peer = rcu_dereference(links->port[i]);
+
+	if (peer == tty0tty)
+		return links == tty0tty->loop ? peer : NULL;
+	if (peer == NULL || READ_ONCE(peer->open_count) <= 0)
+		return NULL;
+	/* a port in local loopback hears nothing from the line */
+	if (READ_ONCE(peer->mcr) & MCR_LOOP)
+		return NULL;
+	return peer;
+}
+
+#define tty0tty_for_each_peer(tty0tty, links, i, peer)			\
+	for (i = 0; (links) != NULL && i < (links)->count; i++)		\
+		if (((peer) = tty0tty_peer(tty0tty, links, i)) == NULL) {} else
+
+/* The port was stopped, a receiver throttled us, or hardware flow
+ * control is on and the peer has RTS (our CTS) low: leave the data in
+ * our fifo, which fills up and holds the writer back through write_room.
+ * All receivers get the same data, so the slowest one sets the pace. */
+static int tty0tty_tx_held(struct tty0tty_serial *tty0tty,
+			   struct tty0tty_links *links)
+{
+	struct tty0tty_serial *peer;
+	unsigned int i;
+
+	if (tty0tty->stopped || tty0tty->break_on)
+		return 1;
+
+	if (tty0tty->crtscts && !(READ_ONCE(tty0tty->msr) & MSR_CTS))
+		return 1;
+
+	tty0tty_for_each_peer(tty0tty, links, i, peer)
+		if (peer->throttled)
+			return 1;
+	return 0;
+}
+
+/* A half-duplex RS-485 port does not hear the line while it drives it. */
+static int tty0tty_rx_off(struct tty0tty_serial *tty0tty)
+{
+	u32 flags = READ_ONCE(tty0tty->rs485.flags);
+
+	if (!(flags & SER_RS485_ENABLED) || (flags & SER_RS485_RX_DURING_TX))
+		return 0;
+	return READ_ONCE(tty0tty->rs485_state) != TTY0TTY_RS485_IDLE;
+}
+
+/* RS-485 RTS delays and breaks are given in ms, and scale with speedup
+ * like the line time */
+static u64 tty0tty_line_delay(struct tty0tty_serial *tty0tty, u32 msecs)
+{
+	if (!tty0tty->speedup)
+		return 0;
+	return div_u64((u64)msecs * NSEC_PER_MSEC, tty0tty->speedup);
+}
+
+/* Change the modem status lines the port sees through the cable, count
+ * the transitions for TIOCGICOUNT and wake up TIOCMIWAIT. */
+static void tty0tty_set_msr(struct tty0tty_serial *tty0tty, int msr)
+{
+	int changed = tty0tty->msr ^ msr;
+
+	tty0tty->msr = msr;
+	if (!changed)
+		return;
+
+	if (changed & MSR_CTS)
+		tty0tty->icount.cts++;
+	if (changed & MSR_DSR)
+		tty0tty->icount.dsr++;
+	if (changed & MSR_CD)
+		tty0tty->icount.dcd++;
+	if (changed & MSR_RI)
+		tty0tty->icount.rng++;
+
+	wake_up_interruptible(&tty0tty->wait);
+}
+
+/* null modem wiring of the outputs of one port to the inputs of another */
+static int tty0tty_mcr_to_msr(int mcr)
+{
+	return ((mcr & MCR_RTS) ? MSR_CTS : 0) |
+	    ((mcr & MCR_DTR) ? MSR_DSR | MSR_CD : 0);
+}
+
+/* Work out the inputs of a port from the outputs of the ports wired to it,
+ * or from its own with MCR_LOOP set. The wiring is symmetric, so those are
+ * the ports on its own list. Called under rcu_read_lock(), after the mcr
+ * that changed was stored: whoever gets the port's mctrl_lock last sees
+ * every change before it, so concurrent ones on other ports are not lost. */
+static void tty0tty_update_msr(struct tty0tty_serial *tty0tty)
+{
+	struct tty0tty_links *links = rcu_dereference(tty0tty->links);
+	struct tty0tty_serial *peer;
+	unsigned long flags;
+	unsigned int i;
 	int msr = 0;
-	int mcr = 0;
 
-	DEBUG_PRINTK(KERN_DEBUG "%s - \n", __FUNCTION__);
+	spin_lock_irqsave(&tty0tty->mctrl_lock, flags);
+	if (tty0tty->mcr & MCR_LOOP) {
+		msr = tty0tty_mcr_to_msr(tty0tty->mcr);
+	} else {
+		/* several drivers on one line: any of them raises it */
+		tty0tty_for_each_peer(tty0tty, links, i, peer)
+			msr |= tty0tty_mcr_to_msr(READ_ONCE(peer->mcr));
+	}
 
-	/* initialize the pointer in case something fails */
-	tty->driver_data = NULL;
+	tty0tty_set_msr(tty0tty, msr);
+	spin_unlock_irqrestore(&tty0tty->mctrl_lock, flags);
+}
 
-	/* get the serial object associated with this tty pointer */
-	index = tty->index;
-	tty0tty = tty0tty_table[index];
-	if (tty0tty == NULL) {
-		/* first time accessing this device, let's create it */
-		tty0tty = kmalloc(sizeof(*tty0tty), GFP_KERNEL);
-		if (!tty0tty)
-			return -ENOMEM;
+/* In-band flow control of a receiving port with IXON: an XOFF among the
+ * received bytes stops its transmitter and an XON lets it go again. The
+ * bytes still reach the line discipline, whose stop_tty() and start_tty()
+ * calls then agree with us. Called with the port's rx_lock held, which is
+ * all the sender has of it; the last one seen is only noted here and
+ * returns 1, the caller acts on it with tty0tty_rx_flow_apply() once it
+ * dropped its own lock. */
+static int tty0tty_rx_flow(struct tty0tty_serial *tty0tty,
+			   const unsigned char *buf, unsigned int count)
+{
+	int flow = 0;
+	unsigned int i;
+
+	if (!tty0tty->ixon)
+		return 0;
+
+	for (i = 0; i < count; i++) {
+		if (buf[i] == tty0tty->stop_char)
+			flow = -1;
+		else if (buf[i] == tty0tty->start_char)
+			flow = 1;
+	}
+	if (flow)
+		tty0tty->rx_flow = flow;
+
+	return flow != 0;
+}
+
+/* drop bytes from the transmit fifo, called with tty0tty->lock held */
+static void tty0tty_tx_discard(struct tty0tty_serial *tty0tty,
+			       unsigned int len)
+{
+	unsigned char chunk[64];
+	unsigned int c;
+
+	for (; len; len -= c)
+		c = kfifo_out(&tty0tty->xmit_fifo, chunk,
+			      min_t(unsigned int, len, sizeof(chunk)));
+}
+
+/* let the line discipline have what is in the flip buffer, called with
+ * rx_lock held */
+static void tty0tty_rx_push(struct tty0tty_serial *tty0tty)
+{
+	tty0tty->rx_pending = 0;
+	tty_flip_buffer_push(tty0tty_flip(tty0tty));
+}
+
+/* Account for @count more bytes in the flip buffer and deliver them the
+ * way a 16550 raises its receive interrupt: once rx_trigger bytes are in
+ * the FIFO, or when nothing more came in for four character times at the
+ * port's own line speed. Called with rx_lock held. */
+static void tty0tty_rx_fill(struct tty0tty_serial *tty0tty,
+			    unsigned int count)
+{
+	u64 timeout = TTY0TTY_RX_TIMEOUT_CHARS * tty0tty->tx_ns_per_byte;
+
+	tty0tty->rx_pending += count;
+	if (!tty0tty->rx_pending)
+		return;
+
+	if (tty0tty->rx_pending >= tty0tty->rx_trigger || !timeout) {
+		tty0tty_rx_push(tty0tty);
+		return;
+	}
+	/* every byte that comes in starts the timeout again */
+	hrtimer_start(&tty0tty->rx_timer, ns_to_ktime(timeout),
+		      HRTIMER_MODE_REL_SOFT);
+}
+
+/* Hand received bytes to a port, called with its rx_lock held. Bytes the
+ * error injector picks go in flagged TTY_PARITY or TTY_FRAME, the rest
+ * as they are. Returns how many the flip buffer took. */
+static unsigned int tty0tty_rx_insert(struct tty0tty_serial *tty0tty,
+				      const unsigned char *buf,
+				      unsigned int count)
+{
+	unsigned int done = 0;
+	unsigned int clean;
+	unsigned int c;
+	int parity;
+	char flag;
+
+	/* parity errors need a parity bit on the line */
+	parity = tty0tty->parity_errors && READ_ONCE(tty0tty->parenb);
+
+	while (done < count) {
+		clean = count - done;
+		if (parity)
+			clean = min(clean, tty0tty->parity_left);
+		if (tty0tty->frame_errors)
+			clean = min(clean, tty0tty->frame_left);
+
+		if (clean) {
+			c = tty_insert_flip_string(tty0tty_flip(tty0tty),
+						   buf + done, clean);
+			done += c;
+			if (parity)
+				tty0tty->parity_left -= c;
+			if (tty0tty->frame_errors)
+				tty0tty->frame_left -= c;
+			if (c < clean)
+				break;
+			continue;
+		}
+
+		/* a byte with a bad stop bit has no good parity either */
+		if (tty0tty->frame_errors && !tty0tty->frame_left)
+			flag = TTY_FRAME;
+		else
+			flag = TTY_PARITY;
+		if (!tty_insert_flip_char(tty0tty_flip(tty0tty), buf[done], flag))
+			break;
+		if (flag == TTY_FRAME)
+			tty0tty->icount.frame++;
+		else
+			tty0tty->icount.parity++;
+		done++;
+		if (parity && !tty0tty->parity_left--)
+			tty0tty->parity_left = tty0tty->parity_errors - 1;
+		if (tty0tty->frame_errors && !tty0tty->frame_left--)
+			tty0tty->frame_left = tty0tty->frame_errors - 1;
+	}
 
-		sema_init(&tty0tty->sem, 1);
-		tty0tty->open_count = 0;
+	return done;
+}
 
-		tty0tty_table[index] = tty0tty;
+/* Move the bytes whose line time has elapsed from the transmit fifo to
+ * the flip buffers of the ports on @links. Called with tty0tty->lock held;
+ * returns the number of bytes taken out of the fifo and sets *flow when
+ * one of the receivers got an XON or XOFF. */
+static unsigned int tty0tty_tx_drain(struct tty0tty_serial *tty0tty,
+				     struct tty0tty_links *links,
+				     int *flow)
+{
+	struct tty0tty_serial *first = NULL;
+	struct tty0tty_serial *peer;
+	unsigned char chunk[256];
+	unsigned char *buf;
+	unsigned int len, count, c, n, i;
+	unsigned int receivers = 0;
+	unsigned int received = 0;
+	u64 now = ktime_get_ns();
+	u64 due;
+
+	/* RS-485: the first byte waits for the driver to be enabled */
+	if (now < tty0tty->tx_last)
+		return 0;
 
+	if (tty0tty_tx_held(tty0tty, links)) {
+		/* the line is idle while we are held */
+		tty0tty->tx_last = now;
+		return 0;
 	}
 
-	tport[index].tty = tty;
-	tty->port = &tport[index];
+	len = kfifo_len(&tty0tty->xmit_fifo);
+	tty0tty_for_each_peer(tty0tty, links, i, peer) {
+		if (tty0tty_rx_off(peer))
+			continue;
+		if (first == NULL)
+			first = peer;
+		receivers++;
+		/* never send more than the receivers can buffer; the flip
+		 * buffer lives in the peer's tty_port, which stays around as
+		 * long as it is wired to us, even if its tty is closing */
+		len = min_t(unsigned int, len,
+			    tty_buffer_space_avail(tty0tty_flip(peer)));
+	}
 
-	if ((index % 2) == 0) {
-		if (tty0tty_table[index + 1] != NULL)
-			if (tty0tty_table[index + 1]->open_count > 0)
-				mcr = tty0tty_table[index + 1]->mcr;
+	if (!tty0tty->tx_ns_per_byte) {
+		count = len;
 	} else {
-		if (tty0tty_table[index - 1] != NULL)
-			if (tty0tty_table[index - 1]->open_count > 0)
-				mcr = tty0tty_table[index - 1]->mcr;
+		due = div64_u64(now - tty0tty->tx_last,
+				tty0tty->tx_ns_per_byte);
+		if (due > len) {
+			/* the line went idle, don't bank the unused time */
+			count = len;
+			tty0tty->tx_last = now;
+		} else {
+			count = due;
+			tty0tty->tx_last += count * tty0tty->tx_ns_per_byte;
+		}
 	}
+	if (!count)
+		return 0;
 
-//null modem connection
+	tty0tty->icount.tx += count;
+	atomic64_add(count, &tty0tty->stats.tx_bytes);
+	atomic64_add(count * tty0tty->tx_ns_per_byte, &tty0tty->stats.pace_ns);
+	atomic64_add(count * tty0tty->nanosecs_per_byte,
+		     &tty0tty->stats.line_ns);
 
-	if ((mcr & MCR_RTS) == MCR_RTS) {
-		msr |= MSR_CTS;
+	/* with nobody on the other end the bytes just leave the wire */
+	if (first == NULL) {
+		tty0tty_tx_discard(tty0tty, count);
+		return count;
 	}
 
-	if ((mcr & MCR_DTR) == MCR_DTR) {
-		msr |= MSR_DSR;
-		msr |= MSR_CD;
+	if (receivers == 1 && !first->parity_errors && !first->frame_errors) {
+		spin_lock(&first->rx_lock);
+		for (len = count; len; len -= c) {
+			/* reserve room in the receiver's flip buffer and copy
+			 * into it straight from our fifo, without a bounce
+			 * buffer */
+			c = tty_prepare_flip_string(tty0tty_flip(first), &buf,
+						    len);
+			if (!c) {
+				/* it could not allocate buffer space */
+				first->icount.buf_overrun += len;
+				atomic64_inc(&first->stats.short_inserts);
+				tty0tty_tx_discard(tty0tty, len);
+				break;
+			}
+			c = kfifo_out(&tty0tty->xmit_fifo, buf, c);
+			received += c;
+			first->icount.rx += c;
+			atomic64_add(c, &first->stats.rx_bytes);
+			if (tty0tty_rx_flow(first, buf, c))
+				*flow = 1;
+		}
+		/* at most one flip buffer work item for this tick */
+		tty0tty_rx_fill(first, received);
+		spin_unlock(&first->rx_lock);
+		return count;
 	}
 
-	tty0tty->msr = msr;
-	tty0tty->mcr = 0;
+	/* Several receivers, or errors to inject: take the bytes out of the
+	 * fifo once and insert them into each receiver from there. Other
+	 * senders on a bus may be feeding the same receivers, one at a time
+	 * under their rx_lock. */
+	for (len = count; len; len -= c) {
+		c = kfifo_out(&tty0tty->xmit_fifo, chunk,
+			      min_t(unsigned int, len, sizeof(chunk)));
+
+		tty0tty_for_each_peer(tty0tty, links, i, peer) {
+			if (tty0tty_rx_off(peer))
+				continue;
+			spin_lock(&peer->rx_lock);
+			n = tty0tty_rx_insert(peer, chunk, c);
+			if (n < c) {
+				peer->icount.buf_overrun += c - n;
+				atomic64_inc(&peer->stats.short_inserts);
+			}
+			peer->icount.rx += n;
+			peer->rx_pending += n;
+			spin_unlock(&peer->rx_lock);
+			atomic64_add(n, &peer->stats.rx_bytes);
+			if (tty0tty_rx_flow(peer, chunk, n))
+				*flow = 1;
+		}
+	}
+
+	/* at most one flip buffer work item per receiver for this tick */
+	tty0tty_for_each_peer(tty0tty, links, i, peer) {
+		spin_lock(&peer->rx_lock);
+		tty0tty_rx_fill(peer, 0);
+		spin_unlock(&peer->rx_lock);
+	}
+
+	return count;
+}
+
+/* Called with tty0tty->lock held once the fifo has room again after a
+ * write() found it full: account for how long writers were held back. */
+static void tty0tty_unblock(struct tty0tty_serial *tty0tty)
+{
+	u64 usecs;
+	int bucket;
+
+	usecs = div_u64(ktime_get_ns() - tty0tty->blocked_since, 1000);
+	bucket = usecs ? fls64(usecs) : 0;
+	if (bucket >= TTY0TTY_HIST_BUCKETS)
+		bucket = TTY0TTY_HIST_BUCKETS - 1;
+
+	atomic64_inc(&tty0tty->stats.blocked[bucket]);
+	tty0tty->blocked_since = 0;
+}
+
+static u64 tty0tty_tx_tick(struct tty0tty_serial *tty0tty)
+{
+	/* everything written within one tick goes out with a single push */
+	return max_t(u64, tty0tty->tx_ns_per_byte,
+		     max_t(u64, coalesce_us, 1) * NSEC_PER_USEC);
+}
+
+/* Called with tty0tty->lock held whenever the baud rate or the speedup
+ * of the port changes. */
+static void tty0tty_set_pace(struct tty0tty_serial *tty0tty,
+			     unsigned int factor)
+{
+	if (factor)
+		tty0tty->tx_ns_per_byte =
+		    DIV_ROUND_CLOSEST_ULL(tty0tty->nanosecs_per_byte, factor);
+	else
+		tty0tty->tx_ns_per_byte = 0;
+}
+
+/* Called with tty0tty->lock held after queueing data: the first byte
+ * starts its line time now. */
+static void tty0tty_tx_start(struct tty0tty_serial *tty0tty)
+{
+	u64 now;
+
+	if (tty0tty->tx_running) {
+		if (tty0tty->rs485_state != TTY0TTY_RS485_TURNAROUND)
+			return;
+		/* RS-485: RTS is still up, send again right away instead of
+		 * waiting out delay_rts_after_send, paced from now on. A
+		 * running callback can't be rearmed from here, it does that
+		 * itself before it returns. */
+		now = ktime_get_ns();
+		tty0tty->rs485_state = TTY0TTY_RS485_SEND;
+		tty0tty->tx_last = max(tty0tty->tx_last, now);
+		if (hrtimer_try_to_cancel(&tty0tty->tx_timer) >= 0)
+			hrtimer_start(&tty0tty->tx_timer,
+				      ns_to_ktime(tty0tty->tx_last - now +
+						  tty0tty_tx_tick(tty0tty)),
+				      HRTIMER_MODE_REL_SOFT);
+		else
+			tty0tty->tx_rearm = 1;
+		return;
+	}
+
+	tty0tty->tx_running = 1;
+	tty0tty->tx_last = ktime_get_ns();
+	if ((tty0tty->rs485.flags & SER_RS485_ENABLED) &&
+	    tty0tty->rs485_state == TTY0TTY_RS485_IDLE) {
+		/* the timer raises RTS right away, data follows the delay */
+		tty0tty->rs485_state = TTY0TTY_RS485_SETUP;
+		hrtimer_start(&tty0tty->tx_timer, ns_to_ktime(0),
+			      HRTIMER_MODE_REL_SOFT);
+		return;
+	}
+	/* without pacing the first write after idle goes out at once, the
+	 * timer only coalesces what follows it */
+	hrtimer_start(&tty0tty->tx_timer,
+		      ns_to_ktime(tty0tty->tx_ns_per_byte ?
+				  tty0tty_tx_tick(tty0tty) : 0),
+		      HRTIMER_MODE_REL_SOFT);
+}
+
+/* Restart a port whose timer stopped with data still queued, after what
+ * held it back went away. */
+static void tty0tty_tx_kick(struct tty0tty_serial *tty0tty)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&tty0tty->lock, flags);
+	if (!kfifo_is_empty(&tty0tty->xmit_fifo))
+		tty0tty_tx_start(tty0tty);
+	spin_unlock_irqrestore(&tty0tty->lock, flags);
+}
+
+/* Stop or restart the transmitter, for XON/XOFF from the line or the line
+ * discipline. The transmit timer reads stopped under the same lock, a
+ * stopped port's timer goes idle on its next tick. */
+static void tty0tty_set_stopped(struct tty0tty_serial *tty0tty, int stopped)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&tty0tty->lock, flags);
+	tty0tty->stopped = stopped;
+	if (!stopped && !kfifo_is_empty(&tty0tty->xmit_fifo))
+		tty0tty_tx_start(tty0tty);
+	spin_unlock_irqrestore(&tty0tty->lock, flags);
+}
+
+/* Act on the XON or XOFF tty0tty_rx_flow() noted for a receiving port,
+ * called without the sender's lock: in loopback that is the same one. */
+static void tty0tty_rx_flow_apply(struct tty0tty_serial *tty0tty)
+{
+	unsigned long flags;
+	int flow;
+
+	spin_lock_irqsave(&tty0tty->rx_lock, flags);
+	flow = tty0tty->rx_flow;
+	tty0tty->rx_flow = 0;
+	spin_unlock_irqrestore(&tty0tty->rx_lock, flags);
+
+	if (flow)
+		tty0tty_set_stopped(tty0tty, flow < 0);
+}
+
+/* With RS-485 enabled a transmission goes IDLE -> SETUP, where RTS is
+ * raised and the first byte waits delay_rts_before_send, -> SEND until the
+ * fifo runs empty -> TURNAROUND, which drops RTS delay_rts_after_send
+ * after the last stop bit, -> IDLE. Data written during the turnaround
+ * goes back to SEND at once with RTS still up, see tty0tty_tx_start(). */
+static enum hrtimer_restart tty0tty_tx_timer(struct hrtimer *timer)
+{
+	struct tty0tty_serial *tty0tty =
+	    container_of(timer, struct tty0tty_serial, tx_timer);
+	struct tty0tty_serial *peer;
+	struct tty0tty_links *links;
+	enum hrtimer_restart ret = HRTIMER_RESTART;
+	unsigned long flags;
+	unsigned int sent;
+	unsigned int i;
+	int flow = 0;
+	int rts = -1;		/* RS-485 level to put RTS at, -1 to leave it */
+	u64 delay;
+
+	rcu_read_lock();
+	links = tty0tty_links(tty0tty);
+	spin_lock_irqsave(&tty0tty->lock, flags);
+	/* what tx_start() found while we waited for the lock is seen below */
+	tty0tty->tx_rearm = 0;
+	if (tty0tty->rs485_state == TTY0TTY_RS485_SETUP) {
+		delay = tty0tty_line_delay(tty0tty,
+					    tty0tty->rs485.delay_rts_before_send);
+		tty0tty->rs485_state = TTY0TTY_RS485_SEND;
+		tty0tty->tx_last = ktime_get_ns() + delay;
+		rts = !!(tty0tty->rs485.flags & SER_RS485_RTS_ON_SEND);
+	} else if (tty0tty->rs485_state == TTY0TTY_RS485_TURNAROUND &&
+		   !kfifo_is_empty(&tty0tty->xmit_fifo)) {
+		/* the line was idle since the last stop bit */
+		tty0tty->rs485_state = TTY0TTY_RS485_SEND;
+		tty0tty->tx_last = max(tty0tty->tx_last, ktime_get_ns());
+	}
+
+	sent = tty0tty_tx_drain(tty0tty, links, &flow);
+	if (sent && tty0tty->blocked_since)
+		tty0tty_unblock(tty0tty);
+
+	if (tty0tty->rs485_state == TTY0TTY_RS485_SEND &&
+	    kfifo_is_empty(&tty0tty->xmit_fifo)) {
+		/* tx_last is where the line time of the last byte ends */
+		delay = tty0tty_line_delay(tty0tty,
+					    tty0tty->rs485.delay_rts_after_send);
+		tty0tty->rs485_state = TTY0TTY_RS485_TURNAROUND;
+		hrtimer_set_expires(timer, ns_to_ktime(tty0tty->tx_last + delay));
+	} else if (tty0tty->rs485_state == TTY0TTY_RS485_TURNAROUND) {
+		tty0tty->rs485_state = TTY0TTY_RS485_IDLE;
+		rts = !!(tty0tty->rs485.flags & SER_RS485_RTS_AFTER_SEND);
+		tty0tty->tx_running = 0;
+		ret = HRTIMER_NORESTART;
+	} else if (sent && !tty0tty->tx_ns_per_byte &&
+		   kfifo_is_empty(&tty0tty->xmit_fifo)) {
+		/* unpaced: wait one more tick for writes that follow,
+		 * they go out together, and stop if none came */
+		hrtimer_forward_now(timer, ns_to_ktime(tty0tty_tx_tick(tty0tty)));
+	} else if (kfifo_is_empty(&tty0tty->xmit_fifo) ||
+		   tty0tty_tx_held(tty0tty, links)) {
+		/* a held port is restarted by whatever released it */
+		tty0tty->tx_running = 0;
+		ret = HRTIMER_NORESTART;
+	} else if (rts >= 0) {
+		/* the first byte is due right after the RTS delay */
+		hrtimer_set_expires(timer,
+				    ns_to_ktime(tty0tty->tx_last +
+						tty0tty_tx_tick(tty0tty)));
+	} else {
+		hrtimer_forward_now(timer, ns_to_ktime(tty0tty_tx_tick(tty0tty)));
+	}
+	spin_unlock_irqrestore(&tty0tty->lock, flags);
+
+	if (rts >= 0)
+		tty0tty_set_mcr(tty0tty, rts ? TIOCM_RTS : 0,
+				rts ? 0 : TIOCM_RTS);
+
+	/* room in the fifo again: let blocked writers and poll() know */
+	if (sent)
+		tty_port_tty_wakeup(&tty0tty->port);
 
-	/* register the tty driver */
+	if (flow) {
+		tty0tty_for_each_peer(tty0tty, links, i, peer)
+			tty0tty_rx_flow_apply(peer);
+	}
+	rcu_read_unlock();
+
+	/* a write during the turnaround that came after we dropped the lock
+	 * must not wait for the expiry set for dropping RTS */
+	if (ret == HRTIMER_RESTART) {
+		spin_lock_irqsave(&tty0tty->lock, flags);
+		if (tty0tty->tx_rearm) {
+			tty0tty->tx_rearm = 0;
+			hrtimer_set_expires(timer,
+					    ns_to_ktime(tty0tty->tx_last +
+							tty0tty_tx_tick(tty0tty)));
+		}
+		spin_unlock_irqrestore(&tty0tty->lock, flags);
+	}
+
+	return ret;
+}
+
+/* the end of a break sent with tcsendbreak() */
+static enum hrtimer_restart tty0tty_break_timer(struct hrtimer *timer)
+{
+	struct tty0tty_serial *tty0tty =
+	    container_of(timer, struct tty0tty_serial, break_timer);
+	unsigned long flags;
+
+	spin_lock_irqsave(&tty0tty->lock, flags);
+	tty0tty->break_on = 0;
+	spin_unlock_irqrestore(&tty0tty->lock, flags);
+
+	tty0tty_tx_kick(tty0tty);
+	return HRTIMER_NORESTART;
+}
+
+/* the receive FIFO timeout */
+static enum hrtimer_restart tty0tty_rx_timer(struct hrtimer *timer)
+{
+	struct tty0tty_serial *tty0tty =
+	    container_of(timer, struct tty0tty_serial, rx_timer);
+	unsigned long flags;
+
+	spin_lock_irqsave(&tty0tty->rx_lock, flags);
+	if (tty0tty->rx_pending)
+		tty0tty_rx_push(tty0tty);
+	spin_unlock_irqrestore(&tty0tty->rx_lock, flags);
+
+	return HRTIMER_NORESTART;
+}
+
+static void tty0tty_init_timers(struct tty0tty_serial *tty0tty)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,13,0)
+	hrtimer_setup(&tty0tty->tx_timer, tty0tty_tx_timer, CLOCK_MONOTONIC,
+		      HRTIMER_MODE_REL_SOFT);
+	hrtimer_setup(&tty0tty->break_timer, tty0tty_break_timer,
+		      CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+	hrtimer_setup(&tty0tty->rx_timer, tty0tty_rx_timer,
+		      CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+#else
+	hrtimer_init(&tty0tty->tx_timer, CLOCK_MONOTONIC,
+		     HRTIMER_MODE_REL_SOFT);
+	tty0tty->tx_timer.function = tty0tty_tx_timer;
+	hrtimer_init(&tty0tty->break_timer, CLOCK_MONOTONIC,
+		     HRTIMER_MODE_REL_SOFT);
+	tty0tty->break_timer.function = tty0tty_break_timer;
+	hrtimer_init(&tty0tty->rx_timer, CLOCK_MONOTONIC,
+		     HRTIMER_MODE_REL_SOFT);
+	tty0tty->rx_timer.function = tty0tty_rx_timer;
+#endif
+}
+
+
+
+static int tty0tty_install(struct tty_driver *driver, struct tty_struct *tty)
+{
+	struct tty0tty_serial *tty0tty;
+	int retval;
+
+	DEBUG_PRINTK(KERN_DEBUG "%s - \n", __FUNCTION__);
 
-	down(&tty0tty->sem);
+	/* the pair may be removed at any time, hold on to the port */
+	mutex_lock(&tty0tty_table_lock);
+	tty0tty = tty0tty_table[tty->index];
+	if (tty0tty != NULL)
+		tty_port_get(&tty0tty->port);
+	mutex_unlock(&tty0tty_table_lock);
+
+	if (tty0tty == NULL)
+		return -ENODEV;
+
+	retval = tty_port_install(&tty0tty->port, driver, tty);
+	if (retval) {
+		tty_port_put(&tty0tty->port);
+		return retval;
+	}
 
-	/* save our structure within the tty structure */
 	tty->driver_data = tty0tty;
-	tty0tty->tty = tty;
+	return 0;
+}
+
+static void tty0tty_cleanup(struct tty_struct *tty)
+{
+	struct tty0tty_serial *tty0tty = tty->driver_data;
+
+	DEBUG_PRINTK(KERN_DEBUG "%s - \n", __FUNCTION__);
+
+	tty->driver_data = NULL;
+	tty_port_put(&tty0tty->port);
+}
+
+static int tty0tty_open(struct tty_struct *tty, struct file *file)
+{
+	struct tty0tty_serial *tty0tty;
+	unsigned long flags;
+	int index;
+
+	DEBUG_PRINTK(KERN_DEBUG "%s - \n", __FUNCTION__);
+
+	/* the serial object was attached by tty0tty_install() */
+	index = tty->index;
+	tty0tty = tty->driver_data;
+
+	tty_port_tty_set(&tty0tty->port, tty);
+
+	/* a port opened for the first time starts with its outputs down and
+	 * its inputs showing the lines of whoever is on the other end; the
+	 * peers see the change and their TIOCMIWAIT waiters wake up. Opening
+	 * it again leaves the lines as they are. */
+	if (!tty0tty->open_count)
+		tty0tty_set_mcr(tty0tty, 0,
+				TIOCM_DTR | TIOCM_RTS | TIOCM_LOOP);
 
+	/* the tty core serializes open and close, the lock is for the
+	 * write path and for peers looking at open_count */
+	spin_lock_irqsave(&tty0tty->lock, flags);
+	tty0tty->tty = tty;
 	++tty0tty->open_count;
+	spin_unlock_irqrestore(&tty0tty->lock, flags);
+	trace_tty0tty_open(index, tty0tty->open_count);
+
+	/* pace the first write with the line settings the port starts with,
+	 * and raise DTR and RTS like tty_port_open() does for a real port */
+	if (tty0tty->open_count == 1) {
+		tty0tty_set_termios(tty, NULL);
+		if (C_BAUD(tty))
+			tty0tty_tiocmset(tty, TIOCM_DTR | TIOCM_RTS, 0);
+	}
 
-	up(&tty0tty->sem);
 	return 0;
 }
 
 static void do_close(struct tty0tty_serial *tty0tty)
 {
-	unsigned int msr = 0;
+	struct tty0tty_serial *peer;
+	struct tty0tty_links *links;
+	unsigned long flags;
+	unsigned int i;
+	int open_count;
 
 	DEBUG_PRINTK(KERN_DEBUG "%s - \n", __FUNCTION__);
 
-	if ((tty0tty->tty->index % 2) == 0) {
-		if (tty0tty_table[tty0tty->tty->index + 1] != NULL)
-			if (tty0tty_table[tty0tty->tty->index + 1]->open_count >
-			    0)
-				tty0tty_table[tty0tty->tty->index + 1]->msr =
-				    msr;
-	} else {
-		if (tty0tty_table[tty0tty->tty->index - 1] != NULL)
-			if (tty0tty_table[tty0tty->tty->index - 1]->open_count >
-			    0)
-				tty0tty_table[tty0tty->tty->index - 1]->msr =
-				    msr;
-	}
-
-	down(&tty0tty->sem);
+	spin_lock_irqsave(&tty0tty->lock, flags);
 	if (!tty0tty->open_count) {
 		/* port was never opened */
-		goto exit;
+		spin_unlock_irqrestore(&tty0tty->lock, flags);
+		return;
 	}
+	open_count = --tty0tty->open_count;
+	spin_unlock_irqrestore(&tty0tty->lock, flags);
+	trace_tty0tty_close(tty0tty->index, open_count);
 
-	--tty0tty->open_count;
-exit:
-	up(&tty0tty->sem);
+	if (open_count)
+		return;
 
-	return;
+	/* nobody is left to see what has not gone out yet */
+	hrtimer_cancel(&tty0tty->tx_timer);
+	hrtimer_cancel(&tty0tty->break_timer);
+	hrtimer_cancel(&tty0tty->rx_timer);
+	spin_lock_irqsave(&tty0tty->lock, flags);
+	kfifo_reset(&tty0tty->xmit_fifo);
+	tty0tty->tx_running = 0;
+	tty0tty->tx_rearm = 0;
+	tty0tty->blocked_since = 0;
+	tty0tty->rs485_state = TTY0TTY_RS485_IDLE;
+	tty0tty->break_on = 0;
+	tty0tty->stopped = 0;
+	spin_unlock_irqrestore(&tty0tty->lock, flags);
+	tty0tty->throttled = 0;
+	tty_port_tty_set(&tty0tty->port, NULL);
+
+	/* our DTR and RTS drop, the peers see their lines go down */
+	spin_lock_irqsave(&tty0tty->mctrl_lock, flags);
+	WRITE_ONCE(tty0tty->mcr, 0);
+	spin_unlock_irqrestore(&tty0tty->mctrl_lock, flags);
+	rcu_read_lock();
+	links = rcu_dereference(tty0tty->links);
+	tty0tty_for_each_peer(tty0tty, links, i, peer)
+		tty0tty_update_msr(peer);
+	rcu_read_unlock();
+
+	/* TIOCMIWAIT sleepers on this port get -EIO */
+	wake_up_interruptible(&tty0tty->wait);
 }
 
 static void tty0tty_close(struct tty_struct *tty, struct file *file)
@@ -212,8 +1086,14 @@ static void tty0tty_close(struct tty_struct *tty, struct file *file)
 
 	DEBUG_PRINTK(KERN_DEBUG "%s - \n", __FUNCTION__);
 
-	if (tty0tty)
-		do_close(tty0tty);
+	if (!tty0tty)
+		return;
+
+	/* like a real UART, let the queued data drain before the last close */
+	if (tty0tty->open_count == 1)
+		tty_wait_until_sent(tty, TTY0TTY_CLOSING_WAIT);
+
+	do_close(tty0tty);
 }
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(6,6,1)
@@ -225,64 +1105,40 @@ static int tty0tty_write(struct tty_struct *tty, const unsigned char *buffer,
 #endif
 {
 	struct tty0tty_serial *tty0tty = tty->driver_data;
+	unsigned long flags;
 	int retval = 0;
-	struct tty_struct *ttyx = NULL;
-	u64 elapsed, delay;
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,10,0)
-	ktime_t start_time = ktime_get_ns();
-#else
-	u64 start_time = ktime_get_ns();
-#endif
+	u64 start = 0;
+	u64 delay = 0;
 
 	if (!tty0tty)
 		return -ENODEV;
 
-	down(&tty0tty->sem);
+	/* no clock reads unless somebody traces */
+	if (trace_tty0tty_write_enabled())
+		start = ktime_get_ns();
+
+	atomic64_inc(&tty0tty->stats.writes);
+
+	spin_lock_irqsave(&tty0tty->lock, flags);
 
 	if (!tty0tty->open_count)
 		/* port was not opened */
 		goto exit;
 
-	if ((tty0tty->tty->index % 2) == 0) {
-		if (tty0tty_table[tty0tty->tty->index + 1] != NULL)
-			if (tty0tty_table[tty0tty->tty->index + 1]->open_count >
-			    0)
-				ttyx =
-				    tty0tty_table[tty0tty->tty->index + 1]->tty;
-	} else {
-		if (tty0tty_table[tty0tty->tty->index - 1] != NULL)
-			if (tty0tty_table[tty0tty->tty->index - 1]->open_count >
-			    0)
-				ttyx =
-				    tty0tty_table[tty0tty->tty->index - 1]->tty;
-	}
-
-//        tty->low_latency=1;
-
-	if (ttyx != NULL) {
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,8,0)
-		tty_insert_flip_string(ttyx->port, buffer, count);
-		tty_flip_buffer_push(ttyx->port);
-#else
-		tty_insert_flip_string(ttyx, buffer, count);
-		tty_flip_buffer_push(ttyx);
-#endif
-		retval = count;
-	}
-
-	/* Compute time spent pushing this buffer */
-	elapsed = ktime_get_ns() - start_time;
-
-	/* Compute how much to wait to make sure this buffer is, from
-	 * userland's point of view, pushed as slow as it would be on
-	 * a real serial port */
-	delay = ((count * tty0tty->nanosecs_per_byte) - elapsed) / 1000;
-
-	if (delay > 1)
-		usleep_range(delay-1, delay);
+	/* queue what fits and return at once, the timer paces it out */
+	retval = kfifo_in(&tty0tty->xmit_fifo, buffer, count);
+	if (retval)
+		tty0tty_tx_start(tty0tty);
+	/* the caller has to wait for room from here on */
+	if (retval < count && !tty0tty->blocked_since)
+		tty0tty->blocked_since = ktime_get_ns();
+	delay = kfifo_len(&tty0tty->xmit_fifo) * tty0tty->tx_ns_per_byte;
 
 exit:
-	up(&tty0tty->sem);
+	spin_unlock_irqrestore(&tty0tty->lock, flags);
+	if (start)
+		trace_tty0tty_write(tty0tty->index, count, retval,
+				    ktime_get_ns() - start, delay);
 	return retval;
 }
 
@@ -293,31 +1149,236 @@ static int tty0tty_write_room(struct tty_struct *tty)
 #endif
 {
 	struct tty0tty_serial *tty0tty = tty->driver_data;
+	unsigned long flags;
 	int room = 0;
 
 	if (!tty0tty)
 		return -ENODEV;
 
-	down(&tty0tty->sem);
-
-	if (!tty0tty->open_count) {
-		/* port was not opened */
-		goto exit;
-	}
+	spin_lock_irqsave(&tty0tty->lock, flags);
 
 	/* calculate how much room is left in the device */
-	room = 255;
+	if (tty0tty->open_count)
+		room = kfifo_avail(&tty0tty->xmit_fifo);
+
+	spin_unlock_irqrestore(&tty0tty->lock, flags);
 
-exit:
-	up(&tty0tty->sem);
 	return room;
 }
 
-#define RELEVANT_IFLAG(iflag) ((iflag) & (IGNBRK|BRKINT|IGNPAR|PARMRK|INPCK))
-
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,1,0)
-static void tty0tty_set_termios(struct tty_struct *tty,
-				const struct ktermios *old_termios)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 14, 0)
+static unsigned int tty0tty_chars_in_buffer(struct tty_struct *tty)
+#else
+static int tty0tty_chars_in_buffer(struct tty_struct *tty)
+#endif
+{
+	struct tty0tty_serial *tty0tty = tty->driver_data;
+	unsigned long flags;
+	int chars;
+
+	if (!tty0tty)
+		return 0;
+
+	spin_lock_irqsave(&tty0tty->lock, flags);
+	chars = kfifo_len(&tty0tty->xmit_fifo);
+	spin_unlock_irqrestore(&tty0tty->lock, flags);
+
+	return chars;
+}
+
+static void tty0tty_flush_buffer(struct tty_struct *tty)
+{
+	struct tty0tty_serial *tty0tty = tty->driver_data;
+	unsigned long flags;
+
+	if (!tty0tty)
+		return;
+
+	spin_lock_irqsave(&tty0tty->lock, flags);
+	kfifo_reset(&tty0tty->xmit_fifo);
+	if (tty0tty->blocked_since)
+		tty0tty_unblock(tty0tty);
+	spin_unlock_irqrestore(&tty0tty->lock, flags);
+
+	tty_wakeup(tty);
+}
+
+/* Send a flow control character ahead of the queued data, the way a UART
+ * sends its x_char before the next byte of the transmit buffer. */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,6,0)
+static void tty0tty_send_xchar(struct tty_struct *tty, u8 ch)
+#else
+static void tty0tty_send_xchar(struct tty_struct *tty, char ch)
+#endif
+{
+	struct tty0tty_serial *tty0tty = tty->driver_data;
+	struct tty0tty_serial *peer;
+	struct tty0tty_links *links;
+	unsigned char c = ch;
+	unsigned long flags;
+	unsigned int i;
+	int flow = 0;
+
+	DEBUG_PRINTK(KERN_DEBUG "%s - %02x\n", __FUNCTION__, c);
+
+	if (!tty0tty || c == __DISABLED_CHAR)
+		return;
+
+	/* the receivers' flip buffers are only fed under our lock */
+	rcu_read_lock();
+	links = tty0tty_links(tty0tty);
+	spin_lock_irqsave(&tty0tty->lock, flags);
+	tty0tty->icount.tx++;
+	tty0tty_for_each_peer(tty0tty, links, i, peer) {
+		if (tty0tty_rx_off(peer))
+			continue;
+		spin_lock(&peer->rx_lock);
+		if (tty_insert_flip_char(tty0tty_flip(peer), c, TTY_NORMAL)) {
+			tty0tty_rx_fill(peer, 1);
+			peer->icount.rx++;
+			flow |= tty0tty_rx_flow(peer, &c, 1);
+		} else {
+			peer->icount.buf_overrun++;
+		}
+		spin_unlock(&peer->rx_lock);
+	}
+	spin_unlock_irqrestore(&tty0tty->lock, flags);
+
+	if (flow) {
+		tty0tty_for_each_peer(tty0tty, links, i, peer)
+			tty0tty_rx_flow_apply(peer);
+	}
+	rcu_read_unlock();
+}
+
+/* TIOCSBRK and TIOCCBRK turn a break on (-1) and off (0), tcsendbreak()
+ * asks for one of @state ms, which the break timer ends. The receivers
+ * get a single TTY_BREAK as it starts; nothing else is sent meanwhile. */
+static int tty0tty_break_ctl(struct tty_struct *tty, int state)
+{
+	struct tty0tty_serial *tty0tty = tty->driver_data;
+	struct tty0tty_serial *peer;
+	struct tty0tty_links *links;
+	unsigned long flags;
+	unsigned int i;
+
+	DEBUG_PRINTK(KERN_DEBUG "%s - %d\n", __FUNCTION__, state);
+
+	if (!tty0tty)
+		return -ENODEV;
+
+	hrtimer_cancel(&tty0tty->break_timer);
+
+	rcu_read_lock();
+	links = tty0tty_links(tty0tty);
+	spin_lock_irqsave(&tty0tty->lock, flags);
+	if (state && !tty0tty->break_on) {
+		tty0tty_for_each_peer(tty0tty, links, i, peer) {
+			if (tty0tty_rx_off(peer))
+				continue;
+			spin_lock(&peer->rx_lock);
+			if (tty_insert_flip_char(tty0tty_flip(peer), 0,
+						 TTY_BREAK)) {
+				/* a break interrupts at once, FIFO or not */
+				tty0tty_rx_push(peer);
+				peer->icount.brk++;
+			} else {
+				peer->icount.buf_overrun++;
+			}
+			spin_unlock(&peer->rx_lock);
+		}
+	}
+	tty0tty->break_on = state != 0;
+	spin_unlock_irqrestore(&tty0tty->lock, flags);
+	rcu_read_unlock();
+
+	if (state > 0)
+		hrtimer_start(&tty0tty->break_timer,
+			      ns_to_ktime(tty0tty_line_delay(tty0tty, state)),
+			      HRTIMER_MODE_REL_SOFT);
+	else if (!state)
+		tty0tty_tx_kick(tty0tty);
+
+	return 0;
+}
+
+/* stop_tty(), from an XOFF the line discipline received or tcflow() */
+static void tty0tty_stop(struct tty_struct *tty)
+{
+	struct tty0tty_serial *tty0tty = tty->driver_data;
+
+	DEBUG_PRINTK(KERN_DEBUG "%s - \n", __FUNCTION__);
+
+	if (!tty0tty)
+		return;
+
+	tty0tty_set_stopped(tty0tty, 1);
+}
+
+static void tty0tty_start(struct tty_struct *tty)
+{
+	struct tty0tty_serial *tty0tty = tty->driver_data;
+
+	DEBUG_PRINTK(KERN_DEBUG "%s - \n", __FUNCTION__);
+
+	if (!tty0tty)
+		return;
+
+	tty0tty_set_stopped(tty0tty, 0);
+}
+
+static void tty0tty_throttle(struct tty_struct *tty)
+{
+	struct tty0tty_serial *tty0tty = tty->driver_data;
+
+	DEBUG_PRINTK(KERN_DEBUG "%s - \n", __FUNCTION__);
+
+	if (!tty0tty)
+		return;
+
+	/* the peer's transmit timer sees this and stops feeding us */
+	tty0tty->throttled = 1;
+
+	/* tell the peer with XOFF or by CTS going low, as configured */
+	if (I_IXOFF(tty))
+		tty0tty_send_xchar(tty, STOP_CHAR(tty));
+	if (C_CRTSCTS(tty))
+		tty0tty_tiocmset(tty, 0, TIOCM_RTS);
+}
+
+static void tty0tty_unthrottle(struct tty_struct *tty)
+{
+	struct tty0tty_serial *tty0tty = tty->driver_data;
+	struct tty0tty_serial *peer;
+	struct tty0tty_links *links;
+	unsigned int i;
+
+	DEBUG_PRINTK(KERN_DEBUG "%s - \n", __FUNCTION__);
+
+	if (!tty0tty)
+		return;
+
+	tty0tty->throttled = 0;
+
+	/* send XON or raise RTS again, which also restarts the peer */
+	if (I_IXOFF(tty))
+		tty0tty_send_xchar(tty, START_CHAR(tty));
+	if (C_CRTSCTS(tty))
+		tty0tty_tiocmset(tty, TIOCM_RTS, 0);
+
+	/* restart the peers that stopped with data still queued */
+	rcu_read_lock();
+	links = tty0tty_links(tty0tty);
+	tty0tty_for_each_peer(tty0tty, links, i, peer)
+		tty0tty_tx_kick(peer);
+	rcu_read_unlock();
+}
+
+#define RELEVANT_IFLAG(iflag) ((iflag) & (IGNBRK|BRKINT|IGNPAR|PARMRK|INPCK))
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,1,0)
+static void tty0tty_set_termios(struct tty_struct *tty,
+				const struct ktermios *old_termios)
 #else
 static void tty0tty_set_termios(struct tty_struct *tty,
 				struct ktermios *old_termios)
@@ -327,6 +1388,7 @@ static void tty0tty_set_termios(struct tty_struct *tty,
 	unsigned int iflag;
 	unsigned int bits_per_byte;
 	unsigned int baud_rate;
+	unsigned long flags;
 	struct tty0tty_serial *tty0tty = tty->driver_data;
 
 	DEBUG_PRINTK(KERN_DEBUG "%s - \n", __FUNCTION__);
@@ -334,13 +1396,18 @@ static void tty0tty_set_termios(struct tty_struct *tty,
 	if (!tty0tty)
 		return;
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,7,0)
 	cflag = tty->termios.c_cflag;
 	iflag = tty->termios.c_iflag;
-#else
-	cflag = tty->termios->c_cflag;
-	iflag = tty->termios->c_iflag;
-#endif
+
+	/* IXON and the flow control characters are not in RELEVANT_IFLAG,
+	 * take them before deciding there is nothing to do */
+	spin_lock_irqsave(&tty0tty->lock, flags);
+	tty0tty->crtscts = !!(cflag & CRTSCTS);
+	tty0tty->parenb = !!(cflag & PARENB);
+	tty0tty->ixon = !!I_IXON(tty);
+	tty0tty->start_char = START_CHAR(tty);
+	tty0tty->stop_char = STOP_CHAR(tty);
+	spin_unlock_irqrestore(&tty0tty->lock, flags);
 
 	/* check that they really want us to change something */
 	if (old_termios) {
@@ -403,6 +1470,8 @@ static void tty0tty_set_termios(struct tty_struct *tty,
 		DEBUG_PRINTK(KERN_DEBUG " - RTS/CTS is enabled\n");
 	} else {
 		DEBUG_PRINTK(KERN_DEBUG " - RTS/CTS is disabled\n");
+		/* data that waited for CTS can go now */
+		tty0tty_tx_kick(tty0tty);
 	}
 
 	/* determine software flow control */
@@ -437,8 +1506,33 @@ static void tty0tty_set_termios(struct tty_struct *tty,
 	baud_rate = tty_get_baud_rate(tty);
 	DEBUG_PRINTK(KERN_DEBUG " - baud rate = %d\n", baud_rate);
 
-	/* get the time a real serial port would require to push a byte */
-	tty0tty->nanosecs_per_byte = 1000000000ULL / (baud_rate / bits_per_byte);
+	if (!baud_rate) {
+		/* B0 hangs up: drop DTR and RTS like a UART driver does and
+		 * keep pacing at the last real rate */
+		tty0tty_set_mcr(tty0tty, 0, TIOCM_DTR | TIOCM_RTS);
+		return;
+	}
+	if (old_termios && (old_termios->c_cflag & CBAUD) == B0) {
+		/* coming back from B0 */
+		if (!C_CRTSCTS(tty) || !tty0tty->throttled)
+			tty0tty_set_mcr(tty0tty, TIOCM_DTR | TIOCM_RTS, 0);
+		else
+			tty0tty_set_mcr(tty0tty, TIOCM_DTR, 0);
+	}
+
+	/* get the time a real serial port would require to push a byte,
+	 * rounded to the nearest ns; truncating the bytes per second first
+	 * was up to 14% off at the slow rates */
+	spin_lock_irqsave(&tty0tty->lock, flags);
+	tty0tty->nanosecs_per_byte =
+	    DIV_ROUND_CLOSEST_ULL((u64)NSEC_PER_SEC * bits_per_byte,
+				  baud_rate);
+	tty0tty->baud_rate = baud_rate;
+	tty0tty->bits_per_byte = bits_per_byte;
+	trace_tty0tty_set_termios(tty0tty->index, baud_rate, bits_per_byte,
+				  tty0tty->nanosecs_per_byte);
+	tty0tty_set_pace(tty0tty, tty0tty->speedup);
+	spin_unlock_irqrestore(&tty0tty->lock, flags);
 	DEBUG_PRINTK(KERN_DEBUG " - time per byte = %lluns\n", tty0tty->nanosecs_per_byte);
 }
 
@@ -448,8 +1542,14 @@ static int tty0tty_tiocmget(struct tty_struct *tty)
 	struct tty0tty_serial *tty0tty = tty->driver_data;
 
 	unsigned int result = 0;
-	unsigned int msr = tty0tty->msr;
-	unsigned int mcr = tty0tty->mcr;
+	unsigned int msr;
+	unsigned int mcr;
+	unsigned long flags;
+
+	spin_lock_irqsave(&tty0tty->mctrl_lock, flags);
+	msr = tty0tty->msr;
+	mcr = tty0tty->mcr;
+	spin_unlock_irqrestore(&tty0tty->mctrl_lock, flags);
 
 	result = ((mcr & MCR_DTR) ? TIOCM_DTR : 0) |	/* DTR is set */
 	    ((mcr & MCR_RTS) ? TIOCM_RTS : 0) |	/* RTS is set */
@@ -462,70 +1562,71 @@ static int tty0tty_tiocmget(struct tty_struct *tty)
 	return result;
 }
 
-//static int tty0tty_tiocmset(struct tty_struct *tty, struct file *file,
-static int tty0tty_tiocmset(struct tty_struct *tty,
+/* Change the outputs of a port, from TIOCMSET or from the transmitter
+ * driving RTS for RS-485. */
+static void tty0tty_set_mcr(struct tty0tty_serial *tty0tty,
 			    unsigned int set, unsigned int clear)
 {
-	struct tty0tty_serial *tty0tty = tty->driver_data;
-	unsigned int mcr = tty0tty->mcr;
-	unsigned int msr = 0;
+	struct tty0tty_serial *peer;
+	struct tty0tty_links *links;
+	unsigned int old_mcr;
+	unsigned int mcr;
+	unsigned long flags;
+	unsigned int i;
 
 	DEBUG_PRINTK(KERN_DEBUG "%s - \n", __FUNCTION__);
 
-	if ((tty0tty->tty->index % 2) == 0) {
-		if (tty0tty_table[tty0tty->tty->index + 1] != NULL)
-			if (tty0tty_table[tty0tty->tty->index + 1]->open_count >
-			    0)
-				msr =
-				    tty0tty_table[tty0tty->tty->index + 1]->msr;
-	} else {
-		if (tty0tty_table[tty0tty->tty->index - 1] != NULL)
-			if (tty0tty_table[tty0tty->tty->index - 1]->open_count >
-			    0)
-				msr =
-				    tty0tty_table[tty0tty->tty->index - 1]->msr;
-	}
+	spin_lock_irqsave(&tty0tty->mctrl_lock, flags);
 
-//null modem connection
+	old_mcr = mcr = tty0tty->mcr;
 
-	if (set & TIOCM_RTS) {
+	if (set & TIOCM_RTS)
 		mcr |= MCR_RTS;
-		msr |= MSR_CTS;
-	}
-
-	if (set & TIOCM_DTR) {
+	if (set & TIOCM_DTR)
 		mcr |= MCR_DTR;
-		msr |= MSR_DSR;
-		msr |= MSR_CD;
-	}
+	if (set & TIOCM_LOOP)
+		mcr |= MCR_LOOP;
 
-	if (clear & TIOCM_RTS) {
+	if (clear & TIOCM_RTS)
 		mcr &= ~MCR_RTS;
-		msr &= ~MSR_CTS;
-	}
-
-	if (clear & TIOCM_DTR) {
+	if (clear & TIOCM_DTR)
 		mcr &= ~MCR_DTR;
-		msr &= ~MSR_DSR;
-		msr &= ~MSR_CD;
-	}
+	if (clear & TIOCM_LOOP)
+		mcr &= ~MCR_LOOP;
+
+	trace_tty0tty_tiocmset(tty0tty->index, old_mcr, mcr,
+			       tty0tty_mcr_to_msr(old_mcr),
+			       tty0tty_mcr_to_msr(mcr));
 
 	/* set the new MCR value in the device */
-	tty0tty->mcr = mcr;
-
-	if ((tty0tty->tty->index % 2) == 0) {
-		if (tty0tty_table[tty0tty->tty->index + 1] != NULL)
-			if (tty0tty_table[tty0tty->tty->index + 1]->open_count >
-			    0)
-				tty0tty_table[tty0tty->tty->index + 1]->msr =
-				    msr;
-	} else {
-		if (tty0tty_table[tty0tty->tty->index - 1] != NULL)
-			if (tty0tty_table[tty0tty->tty->index - 1]->open_count >
-			    0)
-				tty0tty_table[tty0tty->tty->index - 1]->msr =
-				    msr;
+	WRITE_ONCE(tty0tty->mcr, mcr);
+	spin_unlock_irqrestore(&tty0tty->mctrl_lock, flags);
+
+	/* null modem connection; going in or out of loopback also
+	 * connects or disconnects us from the line */
+	rcu_read_lock();
+	tty0tty_update_msr(tty0tty);
+	links = rcu_dereference(tty0tty->links);
+	for (i = 0; links != NULL && i < links->count; i++) {
+		peer = rcu_dereference(links->port[i]);
+		if (peer != NULL && peer != tty0tty)
+			tty0tty_update_msr(peer);
+	}
+
+	/* CTS may have come up for ports waiting to send */
+	if ((mcr & MCR_RTS) || ((old_mcr ^ mcr) & MCR_LOOP)) {
+		tty0tty_tx_kick(tty0tty);
+		tty0tty_for_each_peer(tty0tty, links, i, peer)
+			tty0tty_tx_kick(peer);
 	}
+	rcu_read_unlock();
+}
+
+//static int tty0tty_tiocmset(struct tty_struct *tty, struct file *file,
+static int tty0tty_tiocmset(struct tty_struct *tty,
+			    unsigned int set, unsigned int clear)
+{
+	tty0tty_set_mcr(tty->driver_data, set, clear);
 	return 0;
 }
 
@@ -576,19 +1677,32 @@ static int tty0tty_ioctl_tiocmiwait(struct tty_struct *tty,
 		DECLARE_WAITQUEUE(wait, current);
 		struct async_icount cnow;
 		struct async_icount cprev;
+		unsigned long flags;
 
+		spin_lock_irqsave(&tty0tty->mctrl_lock, flags);
 		cprev = tty0tty->icount;
+		spin_unlock_irqrestore(&tty0tty->mctrl_lock, flags);
 		while (1) {
 			add_wait_queue(&tty0tty->wait, &wait);
 			set_current_state(TASK_INTERRUPTIBLE);
-			schedule();
+			/* a change may have come in since the last look */
+			spin_lock_irqsave(&tty0tty->mctrl_lock, flags);
+			cnow = tty0tty->icount;
+			spin_unlock_irqrestore(&tty0tty->mctrl_lock, flags);
+			if (cnow.rng == cprev.rng && cnow.dsr == cprev.dsr &&
+			    cnow.dcd == cprev.dcd && cnow.cts == cprev.cts &&
+			    tty0tty->open_count)
+				schedule();
+			set_current_state(TASK_RUNNING);
 			remove_wait_queue(&tty0tty->wait, &wait);
 
 			/* see if a signal woke us up */
 			if (signal_pending(current))
 				return -ERESTARTSYS;
 
+			spin_lock_irqsave(&tty0tty->mctrl_lock, flags);
 			cnow = tty0tty->icount;
+			spin_unlock_irqrestore(&tty0tty->mctrl_lock, flags);
 			if (cnow.rng == cprev.rng && cnow.dsr == cprev.dsr &&
 			    cnow.dcd == cprev.dcd && cnow.cts == cprev.cts)
 				return -EIO;	/* no change => error */
@@ -605,28 +1719,47 @@ static int tty0tty_ioctl_tiocmiwait(struct tty_struct *tty,
 	return -ENOIOCTLCMD;
 }
 
-static int tty0tty_ioctl_tiocgicount(struct tty_struct *tty,
-				     unsigned int cmd, unsigned long arg)
+static int tty0tty_get_icount(struct tty_struct *tty,
+			      struct serial_icounter_struct *icount)
 {
 	struct tty0tty_serial *tty0tty = tty->driver_data;
+	struct async_icount cnow;
 
 	DEBUG_PRINTK(KERN_DEBUG "%s - \n", __FUNCTION__);
 
+	if (!tty0tty)
+		return -ENODEV;
+
+	cnow = tty0tty->icount;
+
+	icount->cts = cnow.cts;
+	icount->dsr = cnow.dsr;
+	icount->rng = cnow.rng;
+	icount->dcd = cnow.dcd;
+	icount->rx = cnow.rx;
+	icount->tx = cnow.tx;
+	icount->frame = cnow.frame;
+	icount->overrun = cnow.overrun;
+	icount->parity = cnow.parity;
+	icount->brk = cnow.brk;
+	icount->buf_overrun = cnow.buf_overrun;
+
+	return 0;
+}
+
+static int tty0tty_ioctl_tiocgicount(struct tty_struct *tty,
+				     unsigned int cmd, unsigned long arg)
+{
+	DEBUG_PRINTK(KERN_DEBUG "%s - \n", __FUNCTION__);
+
 	if (cmd == TIOCGICOUNT) {
-		struct async_icount cnow = tty0tty->icount;
 		struct serial_icounter_struct icount;
+		int retval;
 
-		icount.cts = cnow.cts;
-		icount.dsr = cnow.dsr;
-		icount.rng = cnow.rng;
-		icount.dcd = cnow.dcd;
-		icount.rx = cnow.rx;
-		icount.tx = cnow.tx;
-		icount.frame = cnow.frame;
-		icount.overrun = cnow.overrun;
-		icount.parity = cnow.parity;
-		icount.brk = cnow.brk;
-		icount.buf_overrun = cnow.buf_overrun;
+		memset(&icount, 0, sizeof(icount));
+		retval = tty0tty_get_icount(tty, &icount);
+		if (retval)
+			return retval;
 
 		if (copy_to_user((void __user *)arg, &icount, sizeof(icount)))
 			return -EFAULT;
@@ -635,6 +1768,72 @@ static int tty0tty_ioctl_tiocgicount(struct tty_struct *tty,
 	return -ENOIOCTLCMD;
 }
 
+static int tty0tty_ioctl_rs485(struct tty_struct *tty,
+			       unsigned int cmd, unsigned long arg)
+{
+	struct tty0tty_serial *tty0tty = tty->driver_data;
+	struct serial_rs485 __user *argp = (struct serial_rs485 __user *)arg;
+	struct serial_rs485 rs485;
+	struct serial_rs485 conf;
+	unsigned long flags;
+	int idle;
+
+	DEBUG_PRINTK(KERN_DEBUG "%s - \n", __FUNCTION__);
+
+	if (cmd == TIOCGRS485) {
+		spin_lock_irqsave(&tty0tty->lock, flags);
+		conf = tty0tty->rs485;
+		spin_unlock_irqrestore(&tty0tty->lock, flags);
+
+		if (copy_to_user(argp, &conf, sizeof(conf)))
+			return -EFAULT;
+		return 0;
+	}
+
+	if (cmd == TIOCSRS485) {
+		if (copy_from_user(&rs485, argp, sizeof(rs485)))
+			return -EFAULT;
+
+		/* keep what we emulate, the way serial_core cleans it up:
+		 * RTS has one level while sending and the other one after */
+		memset(&conf, 0, sizeof(conf));
+		conf.flags = rs485.flags &
+		    (SER_RS485_ENABLED | SER_RS485_RTS_ON_SEND |
+		     SER_RS485_RTS_AFTER_SEND | SER_RS485_RX_DURING_TX);
+		if (!(conf.flags & SER_RS485_RTS_ON_SEND) ==
+		    !(conf.flags & SER_RS485_RTS_AFTER_SEND)) {
+			conf.flags |= SER_RS485_RTS_ON_SEND;
+			conf.flags &= ~SER_RS485_RTS_AFTER_SEND;
+		}
+		conf.delay_rts_before_send = min_t(u32,
+						   rs485.delay_rts_before_send,
+						   TTY0TTY_RS485_MAX_DELAY);
+		conf.delay_rts_after_send = min_t(u32,
+						  rs485.delay_rts_after_send,
+						  TTY0TTY_RS485_MAX_DELAY);
+
+		spin_lock_irqsave(&tty0tty->lock, flags);
+		tty0tty->rs485 = conf;
+		if (!(conf.flags & SER_RS485_ENABLED))
+			tty0tty->rs485_state = TTY0TTY_RS485_IDLE;
+		idle = tty0tty->rs485_state == TTY0TTY_RS485_IDLE;
+		spin_unlock_irqrestore(&tty0tty->lock, flags);
+
+		/* an idle transmitter leaves RTS at its after-send level */
+		if ((conf.flags & SER_RS485_ENABLED) && idle) {
+			if (conf.flags & SER_RS485_RTS_AFTER_SEND)
+				tty0tty_set_mcr(tty0tty, TIOCM_RTS, 0);
+			else
+				tty0tty_set_mcr(tty0tty, 0, TIOCM_RTS);
+		}
+
+		if (copy_to_user(argp, &conf, sizeof(conf)))
+			return -EFAULT;
+		return 0;
+	}
+	return -ENOIOCTLCMD;
+}
+
 static int tty0tty_ioctl(struct tty_struct *tty,
 			 unsigned int cmd, unsigned long arg)
 {
@@ -647,6 +1846,9 @@ static int tty0tty_ioctl(struct tty_struct *tty,
 		return tty0tty_ioctl_tiocmiwait(tty, cmd, arg);
 	case TIOCGICOUNT:
 		return tty0tty_ioctl_tiocgicount(tty, cmd, arg);
+	case TIOCSRS485:
+	case TIOCGRS485:
+		return tty0tty_ioctl_rs485(tty, cmd, arg);
 	}
 
 	return -ENOIOCTLCMD;
@@ -677,41 +1879,722 @@ static int tty0tty_get_serial(struct tty_struct *tty, struct serial_struct *p)
 }
 
 static struct tty_operations serial_ops = {
+	.install = tty0tty_install,
+	.cleanup = tty0tty_cleanup,
 	.open = tty0tty_open,
 	.close = tty0tty_close,
 	.write = tty0tty_write,
 	.write_room = tty0tty_write_room,
+	.chars_in_buffer = tty0tty_chars_in_buffer,
+	.flush_buffer = tty0tty_flush_buffer,
+	.throttle = tty0tty_throttle,
+	.unthrottle = tty0tty_unthrottle,
+	.stop = tty0tty_stop,
+	.start = tty0tty_start,
+	.send_xchar = tty0tty_send_xchar,
+	.break_ctl = tty0tty_break_ctl,
 	.set_termios = tty0tty_set_termios,
 	.tiocmget = tty0tty_tiocmget,
 	.tiocmset = tty0tty_tiocmset,
 	.ioctl = tty0tty_ioctl,
+	.get_icount = tty0tty_get_icount,
 	.get_serial = tty0tty_get_serial,
 };
 
-static struct tty_driver *tty0tty_tty_driver;
+static ssize_t speedup_show(struct device *dev, struct device_attribute *attr,
+			    char *buf)
+{
+	struct tty0tty_serial *tty0tty = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", tty0tty->speedup);
+}
+
+static ssize_t speedup_store(struct device *dev, struct device_attribute *attr,
+			     const char *buf, size_t count)
+{
+	struct tty0tty_serial *tty0tty = dev_get_drvdata(dev);
+	unsigned long flags;
+	unsigned int factor;
+	int retval;
+
+	retval = kstrtouint(buf, 0, &factor);
+	if (retval)
+		return retval;
+
+	/* an open port switches at once, the next tick uses the new rate */
+	spin_lock_irqsave(&tty0tty->lock, flags);
+	tty0tty->speedup = factor;
+	tty0tty_set_pace(tty0tty, factor);
+	spin_unlock_irqrestore(&tty0tty->lock, flags);
+
+	return count;
+}
+static DEVICE_ATTR_RW(speedup);
+
+/* Error injection: mark one in every N received bytes, 0 turns it off. */
+static ssize_t tty0tty_errors_store(struct device *dev, const char *buf,
+				    size_t count, int frame)
+{
+	struct tty0tty_serial *tty0tty = dev_get_drvdata(dev);
+	unsigned long flags;
+	unsigned int every;
+	int retval;
+
+	retval = kstrtouint(buf, 0, &every);
+	if (retval)
+		return retval;
+
+	spin_lock_irqsave(&tty0tty->rx_lock, flags);
+	if (frame) {
+		tty0tty->frame_errors = every;
+		tty0tty->frame_left = every ? every - 1 : 0;
+	} else {
+		tty0tty->parity_errors = every;
+		tty0tty->parity_left = every ? every - 1 : 0;
+	}
+	spin_unlock_irqrestore(&tty0tty->rx_lock, flags);
+
+	return count;
+}
+
+static ssize_t parity_errors_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	struct tty0tty_serial *tty0tty = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", tty0tty->parity_errors);
+}
+
+static ssize_t parity_errors_store(struct device *dev,
+				   struct device_attribute *attr,
+				   const char *buf, size_t count)
+{
+	return tty0tty_errors_store(dev, buf, count, 0);
+}
+static DEVICE_ATTR_RW(parity_errors);
+
+static ssize_t frame_errors_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
+{
+	struct tty0tty_serial *tty0tty = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", tty0tty->frame_errors);
+}
+
+static ssize_t frame_errors_store(struct device *dev,
+				  struct device_attribute *attr,
+				  const char *buf, size_t count)
+{
+	return tty0tty_errors_store(dev, buf, count, 1);
+}
+static DEVICE_ATTR_RW(frame_errors);
+
+/* Receive FIFO emulation. The FIFO size is reported by TIOCGSERIAL and
+ * bounds the trigger level; a trigger level of 1 delivers every tick. */
+static ssize_t fifo_size_show(struct device *dev,
+			      struct device_attribute *attr, char *buf)
+{
+	struct tty0tty_serial *tty0tty = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%d\n", tty0tty->serial.xmit_fifo_size);
+}
+
+static ssize_t fifo_size_store(struct device *dev,
+			       struct device_attribute *attr,
+			       const char *buf, size_t count)
+{
+	struct tty0tty_serial *tty0tty = dev_get_drvdata(dev);
+	unsigned long flags;
+	unsigned int size;
+	int retval;
+
+	retval = kstrtouint(buf, 0, &size);
+	if (retval)
+		return retval;
+	if (size < 1 || size > TTY0TTY_XMIT_SIZE)
+		return -EINVAL;
+
+	spin_lock_irqsave(&tty0tty->rx_lock, flags);
+	tty0tty->serial.xmit_fifo_size = size;
+	if (tty0tty->rx_trigger > size)
+		tty0tty->rx_trigger = size;
+	spin_unlock_irqrestore(&tty0tty->rx_lock, flags);
+
+	return count;
+}
+static DEVICE_ATTR_RW(fifo_size);
+
+static ssize_t rx_trigger_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
+{
+	struct tty0tty_serial *tty0tty = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", tty0tty->rx_trigger);
+}
+
+static ssize_t rx_trigger_store(struct device *dev,
+				struct device_attribute *attr,
+				const char *buf, size_t count)
+{
+	struct tty0tty_serial *tty0tty = dev_get_drvdata(dev);
+	unsigned long flags;
+	unsigned int trigger;
+	int retval;
+
+	retval = kstrtouint(buf, 0, &trigger);
+	if (retval)
+		return retval;
+
+	spin_lock_irqsave(&tty0tty->rx_lock, flags);
+	if (trigger < 1 || trigger > tty0tty->serial.xmit_fifo_size) {
+		spin_unlock_irqrestore(&tty0tty->rx_lock, flags);
+		return -EINVAL;
+	}
+	tty0tty->rx_trigger = trigger;
+	/* what waits below the old level goes by the new one */
+	tty0tty_rx_fill(tty0tty, 0);
+	spin_unlock_irqrestore(&tty0tty->rx_lock, flags);
+
+	return count;
+}
+static DEVICE_ATTR_RW(rx_trigger);
+
+static struct attribute *tty0tty_dev_attrs[] = {
+	&dev_attr_speedup.attr,
+	&dev_attr_parity_errors.attr,
+	&dev_attr_frame_errors.attr,
+	&dev_attr_fifo_size.attr,
+	&dev_attr_rx_trigger.attr,
+	NULL,
+};
+ATTRIBUTE_GROUPS(tty0tty_dev);
+
+static int tty0tty_stats_show(struct seq_file *m, void *v)
+{
+	struct tty0tty_serial *tty0tty = m->private;
+	struct tty0tty_stats *stats = &tty0tty->stats;
+	struct tty0tty_serial *peer;
+	struct tty0tty_links *links;
+	unsigned int peers = 0;
+	unsigned int j;
+	u64 count;
+	int i;
+
+	rcu_read_lock();
+	links = tty0tty_links(tty0tty);
+	tty0tty_for_each_peer(tty0tty, links, j, peer)
+		peers++;
+	rcu_read_unlock();
+
+	seq_printf(m, "baud: %u\n", tty0tty->baud_rate);
+	seq_printf(m, "bits_per_byte: %u\n", tty0tty->bits_per_byte);
+	seq_printf(m, "speedup: %u\n", tty0tty->speedup);
+	seq_printf(m, "open: %d\n", tty0tty->open_count > 0);
+	seq_printf(m, "peers_open: %u\n", peers);
+	seq_printf(m, "tx_bytes: %llu\n",
+		   (u64)atomic64_read(&stats->tx_bytes));
+	seq_printf(m, "rx_bytes: %llu\n",
+		   (u64)atomic64_read(&stats->rx_bytes));
+	seq_printf(m, "writes: %llu\n", (u64)atomic64_read(&stats->writes));
+	seq_printf(m, "short_inserts: %llu\n",
+		   (u64)atomic64_read(&stats->short_inserts));
+	seq_printf(m, "pace_ns: %llu\n", (u64)atomic64_read(&stats->pace_ns));
+	seq_printf(m, "line_ns: %llu\n", (u64)atomic64_read(&stats->line_ns));
+
+	/* bucket i counts waits of [2^(i-1), 2^i) microseconds */
+	seq_puts(m, "write_blocked_usecs:\n");
+	for (i = 0; i < TTY0TTY_HIST_BUCKETS; i++) {
+		count = atomic64_read(&stats->blocked[i]);
+		if (!count)
+			continue;
+		seq_printf(m, "  %llu-%llu: %llu\n",
+			   i ? 1ULL << (i - 1) : 0ULL, 1ULL << i, count);
+	}
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(tty0tty_stats);
+
+/* called when the last reference to the port is gone */
+static void tty0tty_port_destruct(struct tty_port *port)
+{
+	struct tty0tty_serial *tty0tty =
+	    container_of(port, struct tty0tty_serial, port);
+
+	hrtimer_cancel(&tty0tty->tx_timer);
+	hrtimer_cancel(&tty0tty->break_timer);
+	hrtimer_cancel(&tty0tty->rx_timer);
+	kfifo_free(&tty0tty->xmit_fifo);
+	kfree(tty0tty->loop);
+	kfree(tty0tty);
+}
+
+static const struct tty_port_operations tty0tty_port_ops = {
+	.destruct = tty0tty_port_destruct,
+};
+
+static struct tty0tty_links *tty0tty_alloc_links(unsigned int count)
+{
+	struct tty0tty_links *links;
+
+	links = kzalloc(sizeof(*links) + count * sizeof(links->port[0]),
+			GFP_KERNEL);
+	if (links)
+		links->count = count;
+	return links;
+}
+
+static struct tty0tty_serial *tty0tty_alloc_port(int index)
+{
+	struct tty0tty_serial *tty0tty;
+
+	tty0tty = kzalloc(sizeof(*tty0tty), GFP_KERNEL);
+	if (!tty0tty)
+		return NULL;
+
+	tty0tty->loop = tty0tty_alloc_links(1);
+	if (!tty0tty->loop) {
+		kfree(tty0tty);
+		return NULL;
+	}
+	RCU_INIT_POINTER(tty0tty->loop->port[0], tty0tty);
+
+	if (kfifo_alloc(&tty0tty->xmit_fifo, TTY0TTY_XMIT_SIZE, GFP_KERNEL)) {
+		kfree(tty0tty->loop);
+		kfree(tty0tty);
+		return NULL;
+	}
+
+	tty_port_init(&tty0tty->port);
+	tty0tty->port.ops = &tty0tty_port_ops;
+	spin_lock_init(&tty0tty->lock);
+	spin_lock_init(&tty0tty->rx_lock);
+	spin_lock_init(&tty0tty->mctrl_lock);
+	init_waitqueue_head(&tty0tty->wait);
+	tty0tty_init_timers(tty0tty);
+	tty0tty->index = index;
+	tty0tty->speedup = speedup;
+	tty0tty->serial.xmit_fifo_size = TTY0TTY_FIFO_SIZE;
+	tty0tty->rx_trigger = 1;
+
+	return tty0tty;
+}
+
+/* Point a port at another list, freeing the old one when the last port
+ * using it lets go. Called with tty0tty_table_lock held. */
+static void tty0tty_set_links(struct tty0tty_serial *tty0tty,
+			      struct tty0tty_links *links)
+{
+	struct tty0tty_links *old =
+	    rcu_dereference_protected(tty0tty->links,
+				      lockdep_is_held(&tty0tty_table_lock));
+
+	if (links != NULL && links != tty0tty->loop)
+		links->users++;
+	rcu_assign_pointer(tty0tty->links, links);
+	if (old != NULL && old != tty0tty->loop && !--old->users)
+		kfree_rcu(old, rcu);
+}
+
+static struct tty0tty_links *tty0tty_links_locked(int index)
+{
+	struct tty0tty_serial *tty0tty = tty0tty_table[index];
+
+	if (tty0tty == NULL)
+		return NULL;
+	return rcu_dereference_protected(tty0tty->links,
+					 lockdep_is_held(&tty0tty_table_lock));
+}
+
+/* Take ports first to first + count - 1 off the lists of all the other
+ * ports, whose inputs then no longer see their lines. Called with
+ * tty0tty_table_lock held. */
+static void tty0tty_unlink(int first, int count)
+{
+	struct tty0tty_serial *peer;
+	struct tty0tty_links *links;
+	unsigned int j;
+	int i;
+
+	/* The wiring is symmetric: ports that are on nobody's list have no
+	 * list of their own, like the ones of a pair that is being added. */
+	for (i = first; i < first + count; i++)
+		if (tty0tty_links_locked(i) != NULL)
+			break;
+	if (i == first + count)
+		return;
+
+	for (i = 0; i < 2 * max_pairs; i++) {
+		if (i >= first && i < first + count)
+			continue;
+		links = tty0tty_links_locked(i);
+		if (links == NULL || links->dirty)
+			continue;
+		for (j = 0; j < links->count; j++) {
+			peer = rcu_dereference_protected(links->port[j], 1);
+			if (peer != NULL && peer->index >= first &&
+			    peer->index < first + count) {
+				RCU_INIT_POINTER(links->port[j], NULL);
+				links->dirty = 1;
+			}
+		}
+	}
+
+	rcu_read_lock();
+	for (i = 0; i < 2 * max_pairs; i++) {
+		links = tty0tty_links_locked(i);
+		if (links != NULL && links->dirty &&
+		    (i < first || i >= first + count))
+			tty0tty_update_msr(tty0tty_table[i]);
+	}
+	rcu_read_unlock();
+
+	for (i = 0; i < 2 * max_pairs; i++) {
+		links = tty0tty_links_locked(i);
+		if (links != NULL)
+			links->dirty = 0;
+	}
+}
+
+/* Wire ports first to first + count - 1 together as @topology, see
+ * tty0tty.h. Called with tty0tty_table_lock held. */
+static int tty0tty_wire(int topology, int first, int count)
+{
+	struct tty0tty_links **lists;
+	struct tty0tty_links *links;
+	struct tty0tty_serial *tty0tty;
+	int nlists;
+	int i;
+
+	if (first < 0 || count < 1 || count > 2 * max_pairs - first)
+		return -EINVAL;
+	for (i = 0; i < count; i++)
+		if (tty0tty_table[first + i] == NULL)
+			return -ENOENT;
+
+	switch (topology) {
+	case TTY0TTY_WIRE_PAIR:
+		if (count % 2)
+			return -EINVAL;
+		nlists = count / 2;
+		break;
+	case TTY0TTY_WIRE_LOOP:
+		nlists = 0;
+		break;
+	case TTY0TTY_WIRE_BROADCAST:
+		nlists = 2;
+		break;
+	case TTY0TTY_WIRE_BUS:
+		nlists = 1;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	/* get all the memory first, the old wiring stays if there is none */
+	lists = kcalloc(nlists ? nlists : 1, sizeof(*lists), GFP_KERNEL);
+	if (!lists)
+		return -ENOMEM;
+	for (i = 0; i < nlists; i++) {
+		if (topology == TTY0TTY_WIRE_PAIR)
+			lists[i] = tty0tty_alloc_links(2);
+		else if (topology == TTY0TTY_WIRE_BROADCAST && i == 1)
+			lists[i] = tty0tty_alloc_links(1);
+		else
+			lists[i] = tty0tty_alloc_links(count);
+		if (!lists[i]) {
+			while (i--)
+				kfree(lists[i]);
+			kfree(lists);
+			return -ENOMEM;
+		}
+	}
+
+	/* Each list holds the ports of one cable, the port sending skips
+	 * itself. The hub of a broadcast group has all of them, the others
+	 * only the hub, so one write() reaches every reader and what the
+	 * readers send goes back to the hub alone. */
+	for (i = 0; i < nlists; i++) {
+		links = lists[i];
+		if (topology == TTY0TTY_WIRE_PAIR) {
+			RCU_INIT_POINTER(links->port[0],
+					 tty0tty_table[first + 2 * i]);
+			RCU_INIT_POINTER(links->port[1],
+					 tty0tty_table[first + 2 * i + 1]);
+		} else if (links->count == 1) {
+			RCU_INIT_POINTER(links->port[0], tty0tty_table[first]);
+		} else {
+			unsigned int j;
+
+			for (j = 0; j < links->count; j++)
+				RCU_INIT_POINTER(links->port[j],
+						 tty0tty_table[first + j]);
+		}
+	}
+
+	tty0tty_unlink(first, count);
+	for (i = 0; i < count; i++) {
+		tty0tty = tty0tty_table[first + i];
+		switch (topology) {
+		case TTY0TTY_WIRE_PAIR:
+			links = lists[i / 2];
+			break;
+		case TTY0TTY_WIRE_LOOP:
+			links = tty0tty->loop;
+			break;
+		case TTY0TTY_WIRE_BROADCAST:
+			links = lists[i ? 1 : 0];
+			break;
+		default:
+			links = lists[0];
+			break;
+		}
+		tty0tty_set_links(tty0tty, links);
+	}
+	kfree(lists);
+
+	/* the lines follow the new wiring, and a port that waited for a
+	 * throttled reader may have new ones now */
+	rcu_read_lock();
+	for (i = 0; i < count; i++)
+		tty0tty_update_msr(tty0tty_table[first + i]);
+	rcu_read_unlock();
+	for (i = 0; i < count; i++)
+		tty0tty_tx_kick(tty0tty_table[first + i]);
+
+	return 0;
+}
+
+/* Create pair number @pair, or the first free one if @pair is negative.
+ * Returns the number of the new pair or a negative error. */
+static int tty0tty_add_pair(int pair)
+{
+	struct tty0tty_serial *port[2];
+	struct device *dev;
+	int retval;
+	int i;
+
+	mutex_lock(&tty0tty_table_lock);
+
+	if (pair < 0) {
+		for (pair = 0; pair < max_pairs; pair++)
+			if (tty0tty_table[2 * pair] == NULL)
+				break;
+		if (pair == max_pairs) {
+			retval = -ENOSPC;
+			goto exit;
+		}
+	} else if (pair >= max_pairs) {
+		retval = -EINVAL;
+		goto exit;
+	} else if (tty0tty_table[2 * pair] != NULL) {
+		retval = -EEXIST;
+		goto exit;
+	}
+
+	for (i = 0; i < 2; i++) {
+		port[i] = tty0tty_alloc_port(2 * pair + i);
+		if (!port[i]) {
+			retval = -ENOMEM;
+			goto free;
+		}
+	}
+
+	/* in place and plugged in before the device nodes show up */
+	tty0tty_table[2 * pair] = port[0];
+	tty0tty_table[2 * pair + 1] = port[1];
+	retval = tty0tty_wire(TTY0TTY_WIRE_PAIR, 2 * pair, 2);
+	if (retval) {
+		i = 0;
+		goto unregister;
+	}
+
+	for (i = 0; i < 2; i++) {
+		dev = tty_port_register_device_attr(&port[i]->port,
+						    tty0tty_tty_driver,
+						    2 * pair + i, NULL,
+						    port[i],
+						    tty0tty_dev_groups);
+		if (IS_ERR(dev)) {
+			printk(KERN_ERR "failed to register tnt%d",
+			       2 * pair + i);
+			retval = PTR_ERR(dev);
+			goto unregister;
+		}
+	}
+
+	/* /sys/kernel/debug/tty0tty/tntN/stats */
+	for (i = 0; i < 2; i++) {
+		char name[16];
+
+		snprintf(name, sizeof(name), "tnt%d", 2 * pair + i);
+		port[i]->debugfs = debugfs_create_dir(name, tty0tty_debugfs);
+		debugfs_create_file("stats", S_IRUGO, port[i]->debugfs,
+				    port[i], &tty0tty_stats_fops);
+	}
+
+	retval = pair;
+	goto exit;
+
+unregister:
+	while (i--)
+		tty_unregister_device(tty0tty_tty_driver, 2 * pair + i);
+	tty0tty_set_links(port[0], NULL);
+	tty0tty_set_links(port[1], NULL);
+	tty0tty_table[2 * pair] = NULL;
+	tty0tty_table[2 * pair + 1] = NULL;
+	i = 2;
+free:
+	while (i--)
+		tty_port_put(&port[i]->port);
+exit:
+	mutex_unlock(&tty0tty_table_lock);
+	return retval;
+}
+
+/* Remove a pair. Processes that still have one of its ports open are
+ * hung up; the ports are freed once the last of them closes. */
+static int tty0tty_del_pair(int pair)
+{
+	struct tty0tty_serial *port[2];
+	unsigned long flags;
+	int i;
+
+	if (pair < 0 || pair >= max_pairs)
+		return -EINVAL;
+
+	mutex_lock(&tty0tty_table_lock);
+
+	port[0] = tty0tty_table[2 * pair];
+	port[1] = tty0tty_table[2 * pair + 1];
+	if (port[0] == NULL) {
+		mutex_unlock(&tty0tty_table_lock);
+		return -ENOENT;
+	}
+
+	/* cut the cables, from here on no port finds these two */
+	tty0tty_unlink(2 * pair, 2);
+	tty0tty_set_links(port[0], NULL);
+	tty0tty_set_links(port[1], NULL);
+
+	for (i = 0; i < 2; i++) {
+		debugfs_remove_recursive(port[i]->debugfs);
+		tty_unregister_device(tty0tty_tty_driver, 2 * pair + i);
+
+		/* the cable is cut, don't let the close wait for the fifo */
+		spin_lock_irqsave(&port[i]->lock, flags);
+		kfifo_reset(&port[i]->xmit_fifo);
+		spin_unlock_irqrestore(&port[i]->lock, flags);
+
+		tty_port_tty_hangup(&port[i]->port, false);
+		tty0tty_table[2 * pair + i] = NULL;
+	}
+
+	mutex_unlock(&tty0tty_table_lock);
+
+	/* wait for timers and ioctls that still hold the old links, then
+	 * stop what is in flight */
+	synchronize_rcu();
+	for (i = 0; i < 2; i++) {
+		hrtimer_cancel(&port[i]->tx_timer);
+		hrtimer_cancel(&port[i]->break_timer);
+		hrtimer_cancel(&port[i]->rx_timer);
+		tty_port_put(&port[i]->port);
+	}
+
+	return 0;
+}
+
+static long tty0tty_ctl_ioctl(struct file *file, unsigned int cmd,
+			      unsigned long arg)
+{
+	int __user *argp = (int __user *)arg;
+	struct tty0tty_wiring wiring;
+	int pair;
+	int retval;
+
+	DEBUG_PRINTK(KERN_DEBUG "%s - %04X \n", __FUNCTION__, cmd);
+
+	switch (cmd) {
+	case TTY0TTY_ADD_PAIR:
+		if (get_user(pair, argp))
+			return -EFAULT;
+		retval = tty0tty_add_pair(pair);
+		if (retval < 0)
+			return retval;
+		return put_user(retval, argp);
+	case TTY0TTY_DEL_PAIR:
+		if (get_user(pair, argp))
+			return -EFAULT;
+		return tty0tty_del_pair(pair);
+	case TTY0TTY_SET_WIRING:
+		if (copy_from_user(&wiring, argp, sizeof(wiring)))
+			return -EFAULT;
+		mutex_lock(&tty0tty_table_lock);
+		retval = tty0tty_wire(wiring.topology, wiring.first,
+				      wiring.count);
+		mutex_unlock(&tty0tty_table_lock);
+		return retval;
+	}
+
+	return -ENOTTY;
+}
+
+static const struct file_operations tty0tty_ctl_fops = {
+	.owner = THIS_MODULE,
+	.unlocked_ioctl = tty0tty_ctl_ioctl,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,5,0)
+	.compat_ioctl = compat_ptr_ioctl,
+#endif
+	.llseek = noop_llseek,
+};
+
+/* /dev/tty0tty, creates, removes and rewires pairs */
+static struct miscdevice tty0tty_ctl = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "tty0tty",
+	.fops = &tty0tty_ctl_fops,
+};
 
 static int __init tty0tty_init(void)
 {
+	int wiring;
 	int retval;
 	int i;
-	if (pairs > 128)
-		pairs = 128;
-	if (pairs < 1)
-		pairs = 1;
-	tport = kmalloc(2 * pairs * sizeof(struct tty_port), GFP_KERNEL);
-	tty0tty_table =
-	    kmalloc(2 * pairs * sizeof(struct tty0tty_serial *), GFP_KERNEL);
 
-	for (i = 0; i < 2 * pairs; i++) {
-		tty0tty_table[i] = NULL;
+	for (wiring = 0; wiring < ARRAY_SIZE(tty0tty_topologies); wiring++)
+		if (sysfs_streq(topology, tty0tty_topologies[wiring]))
+			break;
+	if (wiring == ARRAY_SIZE(tty0tty_topologies)) {
+		printk(KERN_ERR "tty0tty: unknown topology %s\n", topology);
+		return -EINVAL;
 	}
 
+	if (max_pairs > TTY0TTY_PAIRS_LIMIT)
+		max_pairs = TTY0TTY_PAIRS_LIMIT;
+	if (max_pairs < 1)
+		max_pairs = 1;
+	if (pairs > max_pairs)
+		pairs = max_pairs;
+	if (pairs < 0)
+		pairs = 0;
+	tty0tty_table =
+	    kcalloc(2 * max_pairs, sizeof(struct tty0tty_serial *), GFP_KERNEL);
+	if (!tty0tty_table)
+		return -ENOMEM;
+
 	DEBUG_PRINTK(KERN_DEBUG "%s - \n", __FUNCTION__);
 
-	/* allocate the tty driver */
-	tty0tty_tty_driver = tty_alloc_driver(2 * pairs, 0);
-	if (!tty0tty_tty_driver)
-		return -ENOMEM;
+	/* allocate the tty driver, ports and devices come with the pairs */
+	tty0tty_tty_driver = tty_alloc_driver(2 * max_pairs,
+					      TTY_DRIVER_RESET_TERMIOS |
+					      TTY_DRIVER_REAL_RAW |
+					      TTY_DRIVER_HARDWARE_BREAK |
+					      TTY_DRIVER_DYNAMIC_DEV);
+	if (IS_ERR(tty0tty_tty_driver)) {
+		kfree(tty0tty_table);
+		return PTR_ERR(tty0tty_tty_driver);
+	}
 
 	/* initialize the tty driver */
 	tty0tty_tty_driver->owner = THIS_MODULE;
@@ -722,8 +2605,6 @@ static int __init tty0tty_init(void)
 	tty0tty_tty_driver->minor_start = TTY0TTY_MINOR;
 	tty0tty_tty_driver->type = TTY_DRIVER_TYPE_SERIAL;
 	tty0tty_tty_driver->subtype = SERIAL_TYPE_NORMAL;
-	tty0tty_tty_driver->flags =
-	    TTY_DRIVER_RESET_TERMIOS | TTY_DRIVER_REAL_RAW;
 	/* no more devfs subsystem */
 	tty0tty_tty_driver->init_termios = tty_std_termios;
 	tty0tty_tty_driver->init_termios.c_iflag = 0;
@@ -735,53 +2616,67 @@ static int __init tty0tty_init(void)
 
 	tty_set_operations(tty0tty_tty_driver, &serial_ops);
 
-	for (i = 0; i < 2 * pairs; i++) {
-		tty_port_init(&tport[i]);
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,7,0)
-		tty_port_link_device(&tport[i], tty0tty_tty_driver, i);
-#endif
-	}
-
 	retval = tty_register_driver(tty0tty_tty_driver);
 	if (retval) {
 		printk(KERN_ERR "failed to register tty0tty tty driver");
-		tty_driver_kref_put(tty0tty_tty_driver);
-		return retval;
+		goto put_driver;
+	}
+
+	retval = misc_register(&tty0tty_ctl);
+	if (retval) {
+		printk(KERN_ERR "failed to register tty0tty control device");
+		goto unregister_driver;
+	}
+
+	/* statistics are optional, a missing debugfs is not an error */
+	tty0tty_debugfs = debugfs_create_dir("tty0tty", NULL);
+
+	for (i = 0; i < pairs; i++) {
+		retval = tty0tty_add_pair(i);
+		if (retval < 0)
+			goto remove_pairs;
+	}
+
+	/* the pairs come wired as pairs, anything else spans all of them */
+	if (wiring != TTY0TTY_WIRE_PAIR && pairs > 0) {
+		mutex_lock(&tty0tty_table_lock);
+		retval = tty0tty_wire(wiring, 0, 2 * pairs);
+		mutex_unlock(&tty0tty_table_lock);
+		if (retval)
+			goto remove_pairs;
 	}
 
 	printk(KERN_INFO DRIVER_DESC " " DRIVER_VERSION "\n");
+	return 0;
+
+remove_pairs:
+	while (i--)
+		tty0tty_del_pair(i);
+	debugfs_remove_recursive(tty0tty_debugfs);
+	misc_deregister(&tty0tty_ctl);
+unregister_driver:
+	tty_unregister_driver(tty0tty_tty_driver);
+put_driver:
+	tty_driver_kref_put(tty0tty_tty_driver);
+	kfree(tty0tty_table);
 	return retval;
 }
 
 static void __exit tty0tty_exit(void)
 {
-	struct tty0tty_serial *tty0tty;
 	int i;
 
 	DEBUG_PRINTK(KERN_DEBUG "%s - \n", __FUNCTION__);
 
-	for (i = 0; i < 2 * pairs; ++i) {
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,7,0)
-		tty_port_destroy(&tport[i]);
-#endif
-		tty_unregister_device(tty0tty_tty_driver, i);
-	}
-	tty_unregister_driver(tty0tty_tty_driver);
+	/* no more pairs can come and go, remove the ones that are left */
+	misc_deregister(&tty0tty_ctl);
+	for (i = 0; i < max_pairs; ++i)
+		if (tty0tty_table[2 * i] != NULL)
+			tty0tty_del_pair(i);
+	debugfs_remove_recursive(tty0tty_debugfs);
 
-	/* shut down all of the timers and free the memory */
-	for (i = 0; i < 2 * pairs; ++i) {
-		tty0tty = tty0tty_table[i];
-		if (tty0tty) {
-			/* close the port */
-			while (tty0tty->open_count)
-				do_close(tty0tty);
-
-			/* shut down our timer and free the memory */
-			kfree(tty0tty);
-			tty0tty_table[i] = NULL;
-		}
-	}
-	kfree(tport);
+	tty_unregister_driver(tty0tty_tty_driver);
+	tty_driver_kref_put(tty0tty_tty_driver);
 	kfree(tty0tty_table);
 }
 
@@ -0,0 +1,49 @@
+/* ########################################################################
+
+   tty0tty - linux null modem emulator (module)
+
+   Control interface of /dev/tty0tty, shared by the module and the
+   programs that add and remove pairs at runtime.
+
+   ########################################################################
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   ######################################################################## */
+
+#ifndef _TTY0TTY_H
+#define _TTY0TTY_H
+
+#include <linux/ioctl.h>
+
+#define TTY0TTY_IOC_MAGIC	'Y'
+
+/* Create a pair. The argument points to the pair number to create, or to
+ * -1 for the first free one; the number of the new pair is written back.
+ * Pair n consists of /dev/tnt<2n> and /dev/tnt<2n+1>. */
+#define TTY0TTY_ADD_PAIR	_IOWR(TTY0TTY_IOC_MAGIC, 1, int)
+
+/* Remove the pair whose number the argument points to. Processes that
+ * still have one of its ports open are hung up. */
+#define TTY0TTY_DEL_PAIR	_IOW(TTY0TTY_IOC_MAGIC, 2, int)
+
+/* How the ports of a group are wired together */
+#define TTY0TTY_WIRE_PAIR	0	/* 1st <=> 2nd, 3rd <=> 4th, ... */
+#define TTY0TTY_WIRE_LOOP	1	/* each port receives what it sends */
+#define TTY0TTY_WIRE_BROADCAST	2	/* 1st => all others, others => 1st */
+#define TTY0TTY_WIRE_BUS	3	/* each port receives all the others */
+
+struct tty0tty_wiring {
+	int topology;		/* TTY0TTY_WIRE_* */
+	int first;		/* first port of the group, /dev/tnt<first> */
+	int count;		/* number of consecutive ports in the group */
+};
+
+/* Rewire an existing group of ports. Ports outside the group that were
+ * connected to one of its ports lose that connection. */
+#define TTY0TTY_SET_WIRING	_IOW(TTY0TTY_IOC_MAGIC, 3, struct tty0tty_wiring)
+
+#endif /* _TTY0TTY_H */
@@ -0,0 +1,125 @@
+/* ########################################################################
+
+   tty0tty - linux null modem emulator (module)
+
+   Tracepoints of the data and control path, see
+   /sys/kernel/tracing/events/tty0tty/ or "perf list tty0tty:*".
+
+   ########################################################################
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   ######################################################################## */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM tty0tty
+
+#if !defined(_TTY0TTY_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TTY0TTY_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* elapsed is the time spent in write(), delay the line time until the
+ * last accepted byte will have left the transmit fifo */
+TRACE_EVENT(tty0tty_write,
+	TP_PROTO(int index, int count, int accepted, u64 elapsed, u64 delay),
+	TP_ARGS(index, count, accepted, elapsed, delay),
+	TP_STRUCT__entry(
+		__field(int, index)
+		__field(int, count)
+		__field(int, accepted)
+		__field(u64, elapsed)
+		__field(u64, delay)
+	),
+	TP_fast_assign(
+		__entry->index = index;
+		__entry->count = count;
+		__entry->accepted = accepted;
+		__entry->elapsed = elapsed;
+		__entry->delay = delay;
+	),
+	TP_printk("tnt%d count=%d accepted=%d elapsed_ns=%llu delay_ns=%llu",
+		  __entry->index, __entry->count, __entry->accepted,
+		  __entry->elapsed, __entry->delay)
+);
+
+TRACE_EVENT(tty0tty_set_termios,
+	TP_PROTO(int index, unsigned int baud, unsigned int bits_per_byte,
+		 u64 nanosecs_per_byte),
+	TP_ARGS(index, baud, bits_per_byte, nanosecs_per_byte),
+	TP_STRUCT__entry(
+		__field(int, index)
+		__field(unsigned int, baud)
+		__field(unsigned int, bits_per_byte)
+		__field(u64, nanosecs_per_byte)
+	),
+	TP_fast_assign(
+		__entry->index = index;
+		__entry->baud = baud;
+		__entry->bits_per_byte = bits_per_byte;
+		__entry->nanosecs_per_byte = nanosecs_per_byte;
+	),
+	TP_printk("tnt%d baud=%u bits_per_byte=%u nanosecs_per_byte=%llu",
+		  __entry->index, __entry->baud, __entry->bits_per_byte,
+		  __entry->nanosecs_per_byte)
+);
+
+/* mcr is the port's own, msr what it shows the ports wired to it */
+TRACE_EVENT(tty0tty_tiocmset,
+	TP_PROTO(int index, unsigned int old_mcr, unsigned int mcr,
+		 unsigned int old_msr, unsigned int msr),
+	TP_ARGS(index, old_mcr, mcr, old_msr, msr),
+	TP_STRUCT__entry(
+		__field(int, index)
+		__field(unsigned int, old_mcr)
+		__field(unsigned int, mcr)
+		__field(unsigned int, old_msr)
+		__field(unsigned int, msr)
+	),
+	TP_fast_assign(
+		__entry->index = index;
+		__entry->old_mcr = old_mcr;
+		__entry->mcr = mcr;
+		__entry->old_msr = old_msr;
+		__entry->msr = msr;
+	),
+	TP_printk("tnt%d mcr=%02x->%02x peer msr=%02x->%02x",
+		  __entry->index, __entry->old_mcr, __entry->mcr,
+		  __entry->old_msr, __entry->msr)
+);
+
+DECLARE_EVENT_CLASS(tty0tty_port,
+	TP_PROTO(int index, int open_count),
+	TP_ARGS(index, open_count),
+	TP_STRUCT__entry(
+		__field(int, index)
+		__field(int, open_count)
+	),
+	TP_fast_assign(
+		__entry->index = index;
+		__entry->open_count = open_count;
+	),
+	TP_printk("tnt%d open_count=%d", __entry->index, __entry->open_count)
+);
+
+DEFINE_EVENT(tty0tty_port, tty0tty_open,
+	TP_PROTO(int index, int open_count),
+	TP_ARGS(index, open_count)
+);
+
+DEFINE_EVENT(tty0tty_port, tty0tty_close,
+	TP_PROTO(int index, int open_count),
+	TP_ARGS(index, open_count)
+);
+
+#endif /* _TTY0TTY_TRACE_H */
+
+/* this part must be outside the header guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE tty0tty_trace
+#include <trace/define_trace.h>
@@ -26,11 +26,30 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <sys/inotify.h>
+#include <sys/timerfd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
 #include <errno.h>
+#include <limits.h>
 
 #ifdef __APPLE__
 #include <term.h>
@@ -38,7 +57,200 @@
 #include <termio.h>
 #endif
 
-static char buffer[1024];
+#define MAX_EVENTS 64
+#define CTL_LINE_MAX 512        /* longest control socket command */
+#define WORK_QUEUE_SIZE 256     /* pairs on their way to a worker */
+#define PTS_NAME_MAX 64
+#define RING_SIZE_DEFAULT 4096
+#define PACE_BURST_NS 10000000ULL /* line time sent in one go when pacing */
+#define URING_ENTRIES 4096      /* io_uring submission queue size */
+
+/* how data is moved between the two masters */
+#define RELAY_COPY   0          /* read() into a ring buffer, then write() */
+#define RELAY_SPLICE 1          /* splice() through a pipe, no user copy */
+
+#ifndef RELAY_MODE_DEFAULT
+#define RELAY_MODE_DEFAULT RELAY_COPY
+#endif
+
+/* what to do when a direction's buffer is full and more data arrives */
+#define OVERFLOW_BLOCK 0        /* stop reading the source until there is room */
+#define OVERFLOW_DROP  1        /* discard the oldest buffered bytes */
+
+/* what waits for the ports to become readable or writable */
+#define BACKEND_EPOLL 0         /* readiness with epoll, then read()/write() */
+#define BACKEND_URING 1         /* reads and writes queued on an io_uring */
+
+/* io_uring user_data: a port pointer with what was queued for it in the
+ * low bits, or one of the constants without a port */
+#define UD_READ   0             /* read of the port's master */
+#define UD_WRITE  1             /* write of the port's data to the peer */
+#define UD_RPOLL  2             /* wait for the master to become readable */
+#define UD_WPOLL  3             /* wait for the peer to become writable */
+#define UD_CANCEL 4             /* cancellation, nothing to do on completion */
+#define UD_EPOLL  5             /* the main thread's epoll set is readable */
+#define UD_MASK   7
+
+/* state of the slave side of a port */
+#define PORT_CLOSED 0           /* never opened since the pair was created */
+#define PORT_OPEN   1
+#define PORT_HUNGUP 2           /* last opener closed it, waiting for a reopen */
+
+/* what the main thread asks a worker to do with a pair */
+#define WORK_ATTACH 0           /* start relaying it */
+#define WORK_DETACH 1           /* stop and free it */
+
+#define container_of(ptr, type, member) \
+  ((type *) ((char *) (ptr) - offsetof(type, member)))
+
+/* The counters of a port are written by the worker that owns it and read
+ * by the main thread for the stats, so both sides use relaxed atomics;
+ * they compile to plain loads and stores. */
+#define stat_add(counter, n) \
+  __atomic_store_n(&(counter), (counter) + (n), __ATOMIC_RELAXED)
+#define stat_get(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+
+/* anything registered with epoll; epoll_event.data.ptr points to one */
+struct source
+{
+  void (*handler)(struct source *src, unsigned int events);
+};
+
+struct pair;
+
+struct ring
+{
+  char *buf;
+  size_t size;
+  size_t head;                  /* oldest byte */
+  size_t len;                   /* bytes stored */
+};
+
+/* A port is one pty master and the direction that carries what its slave
+ * writes over to the peer: either a ring buffer or a splice pipe. */
+struct port
+{
+  struct source src;
+  int fd;                       /* pty master */
+  int state;                    /* PORT_CLOSED, PORT_OPEN or PORT_HUNGUP */
+  int wd;                       /* inotify watch on the slave, or -1 */
+  char slave[PTS_NAME_MAX];
+  char *link;                   /* symlink to the slave, or NULL */
+  int mode;                     /* RELAY_COPY or RELAY_SPLICE */
+  struct ring ring;             /* copy mode buffer towards the peer */
+  int pipe[2];                  /* splice mode pipe towards the peer */
+  size_t inpipe;                /* bytes waiting in the pipe */
+  size_t pipesz;                /* capacity of the pipe */
+  int pipefull;                 /* the pipe refused more data */
+  /* counters of this direction, for SIGUSR1 and the control socket */
+  unsigned long long bytes;     /* written to the peer */
+  unsigned long long reads;     /* read() or splice() calls on the master */
+  unsigned long long writes;    /* write() or splice() calls on the peer */
+  unsigned long long eagains;   /* calls of both kinds that found no room
+                                   or nothing to read */
+  unsigned long long dropped;   /* bytes lost to OVERFLOW_DROP or errors */
+  unsigned long long hangups;   /* times the slave was closed */
+  unsigned long long reopens;   /* times it was opened again after that */
+  unsigned int events;          /* epoll events currently registered */
+  /* baud rate pacing of this direction, from the slave's termios */
+  unsigned long long ns_per_byte; /* line time of one byte, 0 if unpaced */
+  unsigned long long tokens;    /* bytes that may be written right now */
+  unsigned long long pace_last; /* when tokens was last refilled */
+  int paced;                    /* out of tokens, waiting for the timer */
+  int tfd;                      /* timerfd, -1 until pacing first waits */
+  struct source timer_src;
+  /* io_uring backend: what is in flight for this direction */
+  int rd_busy;                  /* read of the master queued */
+  int wr_busy;                  /* write to the peer queued */
+  int wr_cancel;                /* and asked to cancel it */
+  int rd_poll;                  /* a read hit EAGAIN, poll before each */
+  int wr_poll;                  /* a write did, the same */
+  struct port *peer;            /* the other end of the null modem */
+  struct pair *pair;
+};
+
+struct pair
+{
+  struct port port[2];
+  struct worker *worker;        /* the one relaying this pair */
+  struct pair *next;
+};
+
+struct work
+{
+  int op;                       /* WORK_ATTACH or WORK_DETACH */
+  struct pair *pair;
+};
+
+/* An event loop and everything it owns. Each pair belongs to exactly one
+ * worker, which alone touches its ports, so the relay takes no locks. The
+ * main thread hands pairs over through the worker's queue, which has a
+ * single producer and a single consumer and needs no locks either. */
+struct worker
+{
+  pthread_t thread;
+  int epfd;
+  int inofd;                    /* inotify, -1 if not available */
+  struct source inotify_src;
+  struct port **watches;        /* inotify watch descriptor -> port */
+  int nwatches;
+  struct pair *zombies;         /* detached pairs, freed after the events
+                                   in hand are handled */
+  int npairs;                   /* pairs assigned, kept by the main thread */
+  struct work queue[WORK_QUEUE_SIZE];
+  size_t head;                  /* next to take, advanced by the worker */
+  size_t tail;                  /* next free, advanced by the main thread */
+  int evfd;                     /* eventfd that wakes the worker up */
+  struct source queue_src;
+  char buffer[RING_SIZE_DEFAULT]; /* scratch space of the relay */
+};
+
+/* a connection to the control socket */
+struct client
+{
+  struct source src;
+  int fd;
+  unsigned int events;          /* epoll events currently registered */
+  int eof;                      /* closed for writing, send and go */
+  char in[CTL_LINE_MAX];        /* command being received */
+  size_t inlen;
+  char *out;                    /* replies not sent yet */
+  size_t outlen;
+  size_t outoff;
+};
+
+static struct pair *pairs;      /* all of them, kept by the main thread */
+static int npairs;
+static int epfd = -1;           /* main thread's loop, the control socket */
+static int relay_mode = RELAY_MODE_DEFAULT;
+static int overflow = OVERFLOW_BLOCK;
+static int pacing;
+static size_t ring_size = RING_SIZE_DEFAULT;
+static volatile sig_atomic_t stats_requested;
+static int ctlfd = -1;
+static struct source ctl_src;
+static struct worker *workers;
+static int nworkers = 1;
+static int threaded;            /* workers run in threads of their own */
+static int pin;                 /* pin each worker to a CPU */
+static int backend = BACKEND_EPOLL;
+
+/* the rings shared with the kernel, mapped by uring_setup() */
+struct uring
+{
+  int fd;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned sq_entries;
+  struct io_uring_sqe *sqes;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+  unsigned queued;              /* entries not submitted yet */
+};
+
+static struct uring uring = { .fd = -1 };
+
+void uring_update(struct port *from);
+void uring_cancel_write(struct port *from);
 
 int
 ptym_open(char *pts_name, char *pts_name_s , int pts_namesz)
@@ -110,117 +322,2233 @@ tcflush(serialDev, TCIOFLUSH);
   return EXIT_SUCCESS;
 }
 
+size_t
+ring_space(struct ring *ring)
+{
+  return ring->size - ring->len;
+}
+
 void
-copydata(int fdfrom, int fdto)
+ring_drop(struct ring *ring, size_t n)
 {
-  ssize_t br, bw;
-  char *pbuf = buffer;
-  br = read(fdfrom, buffer, 1024);
-  if (br < 0)
+  ring->head = (ring->head + n) % ring->size;
+  ring->len -= n;
+}
+
+/* store n bytes, the caller makes sure they fit */
+void
+ring_put(struct ring *ring, const char *data, size_t n)
+{
+  size_t tail = (ring->head + ring->len) % ring->size;
+  size_t first = ring->size - tail;
+
+  if (first > n)
+    first = n;
+  memcpy(ring->buf + tail, data, first);
+  memcpy(ring->buf, data + first, n - first);
+  ring->len += n;
+}
+
+/* Read from fd into the free part of the ring, which may wrap. With pkt
+ * set, fd is a master in packet mode and the status byte that precedes
+ * the data is stored there; only data bytes are counted in the result. */
+ssize_t
+ring_read(struct ring *ring, int fd, unsigned char *pkt)
+{
+  struct iovec iov[3];
+  size_t tail = (ring->head + ring->len) % ring->size;
+  size_t space = ring_space(ring);
+  int i = 0;
+  ssize_t n;
+
+  if (pkt != NULL)
+  {
+    iov[i].iov_base = pkt;
+    iov[i].iov_len = 1;
+    i++;
+  }
+  iov[i].iov_base = ring->buf + tail;
+  iov[i].iov_len = ring->size - tail;
+  if (iov[i].iov_len > space)
+    iov[i].iov_len = space;
+  iov[i + 1].iov_base = ring->buf;
+  iov[i + 1].iov_len = space - iov[i].iov_len;
+  i += iov[i + 1].iov_len ? 2 : 1;
+
+  n = readv(fd, iov, i);
+  if (n > 0 && pkt != NULL)
+    n--;
+  if (n > 0)
+    ring->len += n;
+  return n;
+}
+
+/* write at most max bytes of the stored part of the ring, which may
+ * wrap, to fd */
+ssize_t
+ring_write(struct ring *ring, int fd, size_t max)
+{
+  struct iovec iov[2];
+  size_t len = ring->len < max ? ring->len : max;
+  ssize_t n;
+
+  iov[0].iov_base = ring->buf + ring->head;
+  iov[0].iov_len = ring->size - ring->head;
+  if (iov[0].iov_len > len)
+    iov[0].iov_len = len;
+  iov[1].iov_base = ring->buf;
+  iov[1].iov_len = len - iov[0].iov_len;
+
+  n = writev(fd, iov, iov[1].iov_len ? 2 : 1);
+  if (n > 0)
+    ring_drop(ring, n);
+  return n;
+}
+
+int
+ring_alloc(struct ring *ring, size_t size)
+{
+  ring->buf = malloc(size);
+  if (ring->buf == NULL)
+  {
+    perror("malloc");
+    return -1;
+  }
+  ring->size = size;
+  ring->head = 0;
+  ring->len = 0;
+  return 0;
+}
+
+/* bytes read from this port's slave and not yet written to the peer */
+size_t
+port_pending(struct port *port)
+{
+  return port->mode == RELAY_SPLICE ? port->inpipe : port->ring.len;
+}
+
+/* room left in this port's direction */
+size_t
+port_room(struct port *port)
+{
+  if (port->mode == RELAY_SPLICE)
+    return port->pipefull ? 0 : port->pipesz - port->inpipe;
+  if (port->ring.buf == NULL)
+    return ring_size;
+  return ring_space(&port->ring);
+}
+
+/* Register interest in exactly what the relay can act on: input while
+ * there is somewhere to put it, output while data waits for this port.
+ * A hung up master reports EPOLLHUP for as long as its slave stays
+ * closed, so it is armed edge triggered and costs no wakeups until the
+ * slave is opened again. */
+void
+port_update(struct port *port)
+{
+  struct epoll_event ev;
+  unsigned int events = 0;
+
+  if (backend == BACKEND_URING)
+  {
+    uring_update(port);
+    return;
+  }
+
+  if (port->state == PORT_HUNGUP)
+  {
+    events = EPOLLIN | EPOLLET;
+  }
+  else
+  {
+    if (overflow == OVERFLOW_DROP || port_room(port) > 0)
+      events |= EPOLLIN;
+    if (port_pending(port->peer) > 0 && !port->peer->paced)
+      events |= EPOLLOUT;
+  }
+
+  if (events == port->events)
+    return;
+
+  ev.events = events;
+  ev.data.ptr = &port->src;
+  if (epoll_ctl(port->pair->worker->epfd, EPOLL_CTL_MOD, port->fd, &ev) < 0)
+  {
+    perror("epoll_ctl");
+    exit(1);
+  }
+  port->events = events;
+}
+
+void
+port_close_pipe(struct port *port)
+{
+  if (port->pipe[0] >= 0)
+    close(port->pipe[0]);
+  if (port->pipe[1] >= 0)
+    close(port->pipe[1]);
+  port->pipe[0] = port->pipe[1] = -1;
+  port->inpipe = 0;
+  port->pipefull = 0;
+}
+
+int
+port_open_pipe(struct port *port)
+{
+  int size;
+
+  if (pipe2(port->pipe, O_NONBLOCK | O_CLOEXEC) < 0)
+  {
+    perror("pipe2");
+    return -1;
+  }
+  /* the pipe is this direction's buffer, size it like the ring */
+  size = fcntl(port->pipe[1], F_SETPIPE_SZ, (int) ring_size);
+  if (size < 0)
+    size = fcntl(port->pipe[1], F_GETPIPE_SZ);
+  port->pipesz = size;
+  return 0;
+}
+
+/* The kernel refused splice() on this pty: move what is left in the pipe
+ * into a ring buffer and keep relaying this direction by copying */
+void
+splice_fallback(struct port *from)
+{
+  size_t size = ring_size > from->inpipe ? ring_size : from->inpipe;
+  ssize_t br;
+
+  fprintf(stderr, "splice not supported on %s, copying instead\n",
+          from->slave);
+  if (ring_alloc(&from->ring, size) < 0)
+    exit(1);
+  while (from->inpipe > 0)
+  {
+    br = ring_read(&from->ring, from->pipe[0], NULL);
+    if (br <= 0)
+      break;
+    from->inpipe -= br;
+  }
+  port_close_pipe(from);
+  __atomic_store_n(&from->mode, RELAY_COPY, __ATOMIC_RELAXED);
+}
+
+unsigned long long
+now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+unsigned int
+baud_rate(speed_t speed)
+{
+  switch (speed)
+  {
+  case B50: return 50;
+  case B75: return 75;
+  case B110: return 110;
+  case B134: return 134;
+  case B150: return 150;
+  case B200: return 200;
+  case B300: return 300;
+  case B600: return 600;
+  case B1200: return 1200;
+  case B1800: return 1800;
+  case B2400: return 2400;
+  case B4800: return 4800;
+  case B9600: return 9600;
+  case B19200: return 19200;
+  case B38400: return 38400;
+  case B57600: return 57600;
+  case B115200: return 115200;
+  case B230400: return 230400;
+  case B460800: return 460800;
+  case B500000: return 500000;
+  case B576000: return 576000;
+  case B921600: return 921600;
+  case B1000000: return 1000000;
+  case B1152000: return 1152000;
+  case B1500000: return 1500000;
+  case B2000000: return 2000000;
+  case B2500000: return 2500000;
+  case B3000000: return 3000000;
+  case B3500000: return 3500000;
+  case B4000000: return 4000000;
+  default: return 0;
+  }
+}
+
+/* Read the line settings the program on the slave asked for and work out
+ * the time one byte takes on the wire, the way tty0tty_set_termios() does
+ * in the module: start bit, data bits, parity and stop bits. */
+void
+pace_termios(struct port *port)
+{
+  struct termios params;
+  unsigned int bits_per_byte;
+  unsigned int baud;
+
+  if (tcgetattr(port->fd, &params) < 0)
+    return;
+
+  switch (params.c_cflag & CSIZE)
+  {
+  case CS5:
+    bits_per_byte = 5;
+    break;
+  case CS6:
+    bits_per_byte = 6;
+    break;
+  case CS7:
+    bits_per_byte = 7;
+    break;
+  default:
+    bits_per_byte = 8;
+    break;
+  }
+  bits_per_byte++;
+  if (params.c_cflag & PARENB)
+    bits_per_byte++;
+  bits_per_byte += (params.c_cflag & CSTOPB) ? 2 : 1;
+
+  /* B0 or an unknown speed: nothing to emulate */
+  baud = baud_rate(cfgetospeed(&params));
+  if (baud == 0)
+    port->ns_per_byte = 0;
+  else
+    port->ns_per_byte = (1000000000ULL * bits_per_byte + baud / 2) / baud;
+}
+
+/* Put the master in packet mode so the relay learns about termios
+ * changes on the slave: with EXTPROC set, every tcsetattr() there
+ * queues a TIOCPKT_IOCTL status byte for the master to read. */
+void
+pace_init(struct port *port)
+{
+  struct termios params;
+  int one = 1;
+
+  if (ioctl(port->fd, TIOCPKT, &one) < 0)
+  {
+    perror("TIOCPKT");
+    return;
+  }
+  if (tcgetattr(port->fd, &params) == 0)
+  {
+    params.c_lflag |= EXTPROC;
+    tcsetattr(port->fd, TCSANOW, &params);
+  }
+  pace_termios(port);
+  port->pace_last = now_ns();
+}
+
+/* Token bucket: bytes that may be written now without going faster than
+ * the line, at most PACE_BURST_NS worth of them at once. A bucket that
+ * overflows means the line went idle, its time is not banked. One that
+ * just filled up keeps the part of a byte time since, which is how late
+ * we woke up; with a bucket of one byte at the slow rates that would
+ * otherwise be lost on every byte. */
+size_t
+pace_budget(struct port *from)
+{
+  unsigned long long now, burst, n;
+
+  if (!pacing || from->ns_per_byte == 0)
+    return SIZE_MAX;
+
+  burst = PACE_BURST_NS / from->ns_per_byte;
+  if (burst == 0)
+    burst = 1;
+
+  now = now_ns();
+  n = (now - from->pace_last) / from->ns_per_byte;
+  from->tokens += n;
+  from->pace_last += n * from->ns_per_byte;
+  if (from->tokens > burst)
+    from->pace_last = now;
+  if (from->tokens >= burst)
+    from->tokens = burst;
+  return from->tokens;
+}
+
+void
+pace_consume(struct port *from, size_t n)
+{
+  if (pacing && from->ns_per_byte != 0)
+    from->tokens -= n;
+}
+
+void pace_handler(struct source *src, unsigned int events);
+
+/* out of tokens: sleep on the timerfd, not in the relay, until the next
+ * chunk may go out, so other pairs keep moving meanwhile */
+void
+pace_wait(struct port *from)
+{
+  struct itimerspec its;
+  struct epoll_event ev;
+  unsigned long long half, want, when;
+
+  if (from->tfd < 0)
   {
-    if (errno == EAGAIN || errno == EIO)
+    from->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (from->tfd < 0)
     {
-      br = 0;
+      perror("timerfd_create");
+      exit(1);
     }
-    else
+    from->timer_src.handler = pace_handler;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &from->timer_src;
+    if (epoll_ctl(from->pair->worker->epfd, EPOLL_CTL_ADD, from->tfd,
+                  &ev) < 0)
     {
-      perror("read");
+      perror("epoll_ctl");
       exit(1);
     }
   }
-  if (br > 0)
+
+  /* wake up with the bucket half full, so a late wakeup finds room for
+   * the tokens that came meanwhile instead of losing them */
+  half = PACE_BURST_NS / from->ns_per_byte / 2;
+  if (half == 0)
+    half = 1;
+  want = port_pending(from);
+  if (want > half)
+    want = half;
+  when = from->pace_last + (want - from->tokens) * from->ns_per_byte;
+
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec = when / 1000000000ULL;
+  its.it_value.tv_nsec = when % 1000000000ULL;
+  if (timerfd_settime(from->tfd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
   {
-    do
-    {
-      do
-      {
-        bw = write(fdto, pbuf, br);
-        if (bw > 0)
-        {
-          pbuf += bw;
-          br -= bw;
-        }
-      } while (br > 0 && bw > 0);
-    } while (bw < 0 && errno == EAGAIN);
-    if (bw <= 0)
-    {
-      // kernel buffer may be full, but we can recover
-      fprintf(stderr, "Write error, br=%d bw=%d\n", (int) br, (int) bw);
-      usleep(500000);
-      // discard input
-      while (read(fdfrom, buffer, 1024) > 0)
-        ;
-    }
+    perror("timerfd_settime");
+    exit(1);
   }
-  else
+  from->paced = 1;
+}
+
+/* discard everything waiting in this direction */
+void
+relay_discard(struct port *from)
+{
+  struct worker *worker = from->pair->worker;
+
+  /* io_uring may be writing out of the ring: that has to be cancelled
+   * first, its completion comes back here */
+  if (from->wr_busy)
+  {
+    uring_cancel_write(from);
+    return;
+  }
+  stat_add(from->dropped, port_pending(from));
+  if (from->mode == RELAY_SPLICE)
+  {
+    while (from->inpipe > 0 &&
+           read(from->pipe[0], worker->buffer, sizeof(worker->buffer)) > 0)
+      ;
+    from->inpipe = 0;
+    from->pipefull = 0;
+  }
+  else if (from->ring.len > 0)
   {
-    usleep(100000);
+    /* the free part of the ring stays where it is, a read may be
+     * queued into it */
+    ring_drop(&from->ring, from->ring.len);
   }
 }
 
-int main(int argc, char* argv[])
+/* move as much buffered data as the peer accepts without blocking */
+void
+relay_write(struct port *from)
 {
-  char master1[1024];
-  char slave1[1024];
-  char master2[1024];
-  char slave2[1024];
+  ssize_t bw;
+
+  /* nobody is listening on the other side, the data goes nowhere */
+  if (from->peer->state == PORT_HUNGUP)
+  {
+    relay_discard(from);
+    return;
+  }
+
+  if (from->paced)
+    return;
+
+  while (port_pending(from) > 0)
+  {
+    size_t max = pace_budget(from);
 
-  int fd1;
-  int fd2;
+    if (max == 0)
+    {
+      pace_wait(from);
+      break;
+    }
+    if (from->mode == RELAY_SPLICE)
+    {
+      bw = splice(from->pipe[0], NULL, from->peer->fd, NULL,
+                  from->inpipe < max ? from->inpipe : max,
+                  SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (bw > 0)
+      {
+        from->inpipe -= bw;
+        from->pipefull = 0;
+      }
+    }
+    else
+    {
+      bw = ring_write(&from->ring, from->peer->fd, max);
+    }
+    stat_add(from->writes, 1);
+    if (bw > 0)
+    {
+      stat_add(from->bytes, bw);
+      pace_consume(from, bw);
+      continue;
+    }
+    if (bw < 0 && errno == EAGAIN)
+    {
+      stat_add(from->eagains, 1);
+      break;                    /* wait for EPOLLOUT on the peer */
+    }
+    if (bw < 0 && errno == EINTR)
+      continue;
+    if (bw < 0 && errno == EINVAL && from->mode == RELAY_SPLICE)
+    {
+      splice_fallback(from);
+      continue;
+    }
+    fprintf(stderr, "Write error, br=%d bw=%d\n", (int) port_pending(from),
+            (int) bw);
+    relay_discard(from);
+    break;
+  }
+}
 
-  fd_set rfds;
-  int retval;
+void
+port_hangup(struct port *port)
+{
+  __atomic_store_n(&port->state, PORT_HUNGUP, __ATOMIC_RELAXED);
+  stat_add(port->hangups, 1);
+  /* what was on its way to the slave would be lost on reopen anyway */
+  relay_discard(port->peer);
+}
 
-  fd1=ptym_open(master1,slave1,1024);
+void
+port_opened(struct port *port)
+{
+  if (port->state == PORT_HUNGUP)
+    stat_add(port->reopens, 1);
+  __atomic_store_n(&port->state, PORT_OPEN, __ATOMIC_RELAXED);
+}
 
-  fd2=ptym_open(master2,slave2,1024);
+void
+relay_read(struct port *from)
+{
+  char *buffer = from->pair->worker->buffer;
+  unsigned char pkt = 0;
+  ssize_t br;
 
-  if (argc >= 3)
+  if (from->mode == RELAY_SPLICE)
   {
-    unlink(argv[1]);
-    unlink(argv[2]);
-    if (symlink(slave1, argv[1]) < 0)
-	{
-      fprintf(stderr, "Cannot create: %s\n", argv[1]);
-      return 1;
+    if (port_room(from) == 0)
+    {
+      if (overflow != OVERFLOW_DROP)
+        return;
+      br = read(from->pipe[0], buffer, RING_SIZE_DEFAULT);
+      if (br > 0)
+      {
+        from->inpipe -= br;
+        stat_add(from->dropped, br);
+      }
+      from->pipefull = 0;
     }
-    if (symlink(slave2, argv[2]) < 0) {
-      fprintf(stderr, "Cannot create: %s\n", argv[2]);
-      return 1;
+    br = splice(from->fd, NULL, from->pipe[1], NULL,
+                from->pipesz - from->inpipe,
+                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (br < 0 && errno == EINVAL)
+    {
+      splice_fallback(from);
+      relay_read(from);
+      return;
     }
-    printf("(%s) <=> (%s)\n",argv[1],argv[2]);
+    if (br > 0)
+      from->inpipe += br;
+    /* every splice takes a whole pipe slot, so the pipe can be full
+     * before inpipe reaches pipesz: stop reading until it drains */
+    if (br < 0 && errno == EAGAIN && from->inpipe > 0)
+      from->pipefull = 1;
   }
-  else {
-    printf("(%s) <=> (%s)\n",slave1,slave2);
+  else
+  {
+    if (from->ring.buf == NULL && ring_alloc(&from->ring, ring_size) < 0)
+      exit(1);
+    if (ring_space(&from->ring) > 0)
+    {
+      br = ring_read(&from->ring, from->fd, pacing ? &pkt : NULL);
+    }
+    else
+    {
+      char *data = pacing ? buffer + 1 : buffer;
+      size_t max = RING_SIZE_DEFAULT - (data - buffer);
+
+      if (overflow != OVERFLOW_DROP)
+        return;
+      if (max > from->ring.size)
+        max = from->ring.size;
+      br = read(from->fd, buffer, max + (data - buffer));
+      if (br > 0 && pacing)
+      {
+        pkt = buffer[0];
+        br--;
+      }
+      if (br > 0)
+      {
+        ring_drop(&from->ring, br);
+        ring_put(&from->ring, data, br);
+        stat_add(from->dropped, br);
+      }
+    }
   }
 
-  conf_ser(fd1);
-  conf_ser(fd2);
+  stat_add(from->reads, 1);
 
-  while(1)
+  /* the program on the slave changed the line settings */
+  if (pkt & TIOCPKT_IOCTL)
+    pace_termios(from);
+
+  if (br < 0)
   {
-    FD_ZERO(&rfds);
-    FD_SET(fd1, &rfds);
-    FD_SET(fd2, &rfds);
+    if (errno == EIO)
+    {
+      /* the slave is closed and everything it wrote has been read */
+      port_hangup(from);
+    }
+    else if (errno == EAGAIN)
+    {
+      stat_add(from->eagains, 1);
+    }
+    else if (errno != EINTR)
+    {
+      perror("read");
+      exit(1);
+    }
+  }
+
+  relay_write(from);
+}
+
+void
+pace_handler(struct source *src, unsigned int events)
+{
+  struct port *port = container_of(src, struct port, timer_src);
+  unsigned long long expirations;
+
+  /* the pair was deleted while this event was waiting */
+  if (port->tfd < 0)
+    return;
+  if (read(port->tfd, &expirations, sizeof(expirations)) < 0)
+    return;
+  port->paced = 0;
+  relay_write(port);
+  port_update(port);
+  port_update(port->peer);
+}
+
+void
+port_handler(struct source *src, unsigned int events)
+{
+  struct port *port = container_of(src, struct port, src);
+
+  /* the pair was deleted while this event was waiting */
+  if (port->fd < 0)
+    return;
 
-    retval = select(fd2 + 1, &rfds, NULL, NULL, NULL);
-    if (retval == -1)
+  if (events & EPOLLHUP)
+  {
+    /* the slave is closed: collect what it left behind, if there is
+     * room for it, then wait for it to be opened again */
+    if (port->state != PORT_HUNGUP)
     {
-      perror("select");
-      return 1;
+      relay_read(port);
+      if (port->state != PORT_HUNGUP && port_room(port) == 0)
+        port_hangup(port);
     }
-    if (FD_ISSET(fd1, &rfds))
+  }
+  else
+  {
+    /* only an open slave clears EPOLLHUP */
+    if (port->state != PORT_OPEN)
+      port_opened(port);
+    if (events & (EPOLLIN | EPOLLERR))
+      relay_read(port);
+  }
+  if (events & EPOLLOUT)
+    relay_write(port->peer);
+  port_update(port);
+  port_update(port->peer);
+}
+
+/* a slave was opened: start relaying to it without waiting for it to
+ * write something first */
+void
+inotify_handler(struct source *src, unsigned int events)
+{
+  struct worker *worker = container_of(src, struct worker, inotify_src);
+  char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  const struct inotify_event *ev;
+  struct port *port;
+  ssize_t len;
+  char *ptr;
+
+  while ((len = read(worker->inofd, buf, sizeof(buf))) > 0)
+  {
+    for (ptr = buf; ptr < buf + len; ptr += sizeof(*ev) + ev->len)
     {
-      copydata(fd1, fd2);
+      ev = (const struct inotify_event *) ptr;
+      if (ev->wd < 0 || ev->wd >= worker->nwatches ||
+          worker->watches[ev->wd] == NULL)
+        continue;
+      port = worker->watches[ev->wd];
+      if ((ev->mask & IN_OPEN) && port->state == PORT_HUNGUP)
+      {
+        port_opened(port);
+        port_update(port);
+        port_update(port->peer);
+      }
     }
-    if (FD_ISSET(fd2, &rfds))
+  }
+}
+
+void
+port_watch(struct port *port)
+{
+  struct worker *worker = port->pair->worker;
+  struct port **w;
+  int wd;
+
+  port->wd = -1;
+  if (worker->inofd < 0)
+    return;
+  wd = inotify_add_watch(worker->inofd, port->slave, IN_OPEN);
+  if (wd < 0)
+  {
+    perror(port->slave);
+    return;
+  }
+  if (wd >= worker->nwatches)
+  {
+    w = realloc(worker->watches, (wd + 64) * sizeof(*w));
+    if (w == NULL)
     {
-      copydata(fd2, fd1);
+      perror("realloc");
+      inotify_rm_watch(worker->inofd, wd);
+      return;
     }
+    memset(w + worker->nwatches, 0,
+           (wd + 64 - worker->nwatches) * sizeof(*w));
+    worker->watches = w;
+    worker->nwatches = wd + 64;
   }
+  worker->watches[wd] = port;
+  port->wd = wd;
+}
 
-  close(fd1);
-  close(fd2);
+const char *
+port_state(struct port *port)
+{
+  switch (stat_get(port->state))
+  {
+  case PORT_OPEN:
+    return "open";
+  case PORT_HUNGUP:
+    return "hung-up";
+  default:
+    return "closed";
+  }
+}
+
+const char *
+port_name(struct port *port)
+{
+  return port->link != NULL ? port->link : port->slave;
+}
+
+/* Fill and size of this port's direction buffer, as seen from the main
+ * thread while a worker may be relaying: a snapshot, not exact. */
+size_t
+port_fill(struct port *port, size_t *size)
+{
+  if (stat_get(port->mode) == RELAY_SPLICE)
+  {
+    *size = port->pipesz;
+    return stat_get(port->inpipe);
+  }
+  *size = stat_get(port->ring.size);
+  if (*size == 0)
+    *size = ring_size;
+  return stat_get(port->ring.len);
+}
+
+/* One line per direction, named after the port whose slave sends: the
+ * state of that slave and what went from it to the peer. */
+void
+print_stats(FILE *f)
+{
+  struct pair *pair;
+  size_t fill, size;
+  int i;
+
+  for (pair = pairs; pair != NULL; pair = pair->next)
+  {
+    for (i = 0; i < 2; i++)
+    {
+      struct port *port = &pair->port[i];
+
+      fill = port_fill(port, &size);
+      fprintf(f, "(%s) => (%s): bytes %llu, reads %llu, writes %llu, "
+              "eagain %llu, dropped %llu, pending %zu/%zu, state %s, "
+              "hangups %llu, reopens %llu\n",
+              port_name(port), port_name(port->peer), stat_get(port->bytes),
+              stat_get(port->reads), stat_get(port->writes),
+              stat_get(port->eagains), stat_get(port->dropped), fill, size,
+              port_state(port), stat_get(port->hangups),
+              stat_get(port->reopens));
+    }
+  }
+}
+
+void
+request_stats(int sig)
+{
+  stats_requested = 1;
+}
+
+void
+usage(const char *prog)
+{
+  fprintf(stderr,
+          "usage: %s [-p] [-m copy|splice] [-b size] [-o block|drop] "
+          "[-n count] [-f file]\n"
+          "       [-c socket] [-t count] [-a] [-e epoll|uring] "
+          "[link1 link2 [link3 link4 ...]]\n"
+          "  -p        pace each direction at the baud rate set on its slave\n"
+          "  -m mode   relay data by copying or with splice() (default %s)\n"
+          "  -b size   buffer size for each direction (default %d)\n"
+          "  -o policy when a buffer is full, block the sender or drop the "
+          "oldest data\n"
+          "  -n count  create count pairs without symlinks\n"
+          "  -f file   read pairs from file, one \"link1 link2\" per line\n"
+          "  -c socket listen for commands on this unix socket: stats, "
+          "add [link1 link2],\n"
+          "            del name, link name newlink\n"
+          "  -t count  relay in count threads, 0 for one per CPU\n"
+          "  -a        pin each thread to a CPU of its own\n"
+          "  -e loop   wait for the ports with epoll or queue the relay on "
+          "an io_uring\n"
+          "            (default epoll)\n"
+          "SIGUSR1 prints the counters of each direction to stderr.\n",
+          prog, RELAY_MODE_DEFAULT == RELAY_SPLICE ? "splice" : "copy",
+          RING_SIZE_DEFAULT);
+}
+
+/* Close everything the port holds. Its handlers ignore events that were
+ * already collected for it by finding fd and tfd at -1. The ring stays
+ * until the pair is reaped, io_uring may still be using it. */
+void
+port_free(struct port *port)
+{
+  if (port->fd >= 0)
+    close(port->fd);
+  port->fd = -1;
+  port_close_pipe(port);
+  if (port->wd >= 0)
+  {
+    port->pair->worker->watches[port->wd] = NULL;
+    inotify_rm_watch(port->pair->worker->inofd, port->wd);
+  }
+  port->wd = -1;
+  if (port->tfd >= 0)
+    close(port->tfd);
+  port->tfd = -1;
+  free(port->link);
+  port->link = NULL;
+}
+
+/* Remove a symlink at path, if there is one. Anything else is left alone,
+ * names come from the control socket and only links are ours to delete. */
+int
+unlink_symlink(const char *path)
+{
+  struct stat st;
+
+  if (lstat(path, &st) < 0)
+    return errno == ENOENT ? 0 : -1;
+  if (!S_ISLNK(st.st_mode))
+  {
+    errno = EEXIST;
+    return -1;
+  }
+  return unlink(path);
+}
+
+/* point link at the port's slave, replacing the link it had */
+int
+port_link(struct port *port, const char *link)
+{
+  char *copy;
+
+  copy = strdup(link);
+  if (copy == NULL)
+    return -1;
+  if (unlink_symlink(link) < 0 || symlink(port->slave, link) < 0)
+  {
+    free(copy);
+    return -1;
+  }
+  if (port->link != NULL && strcmp(port->link, link) != 0)
+    unlink_symlink(port->link);
+  free(port->link);
+  port->link = copy;
+  return 0;
+}
+
+/* the port whose symlink or slave is called name */
+struct port *
+port_find(const char *name)
+{
+  struct pair *pair;
+  int i;
+
+  for (pair = pairs; pair != NULL; pair = pair->next)
+    for (i = 0; i < 2; i++)
+      if (strcmp(port_name(&pair->port[i]), name) == 0 ||
+          strcmp(pair->port[i].slave, name) == 0)
+        return &pair->port[i];
+  return NULL;
+}
+
+/* Map the rings of a new io_uring and check that the kernel has the
+ * operations the relay queues. Raw system calls, without liburing. */
+int
+uring_setup(void)
+{
+  static const int ops[] = { IORING_OP_READ, IORING_OP_WRITE,
+                             IORING_OP_POLL_ADD, IORING_OP_ASYNC_CANCEL };
+  struct io_uring_params params;
+  struct io_uring_probe *probe;
+  size_t size, cqsize;
+  char *sq;
+  unsigned i;
+
+  memset(&params, 0, sizeof(params));
+  /* a pair has up to a read, a write and two polls in flight per port */
+  params.flags = IORING_SETUP_CQSIZE;
+  params.cq_entries = 8 * URING_ENTRIES;
+  uring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+  if (uring.fd < 0)
+    return -1;
+
+  errno = ENOSYS;
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+      !(params.features & IORING_FEAT_NODROP))
+    goto fail;
+  probe = calloc(1, sizeof(*probe) + 256 * sizeof(probe->ops[0]));
+  if (probe == NULL)
+    goto fail;
+  if (syscall(__NR_io_uring_register, uring.fd, IORING_REGISTER_PROBE, probe,
+              256) < 0)
+  {
+    free(probe);
+    goto fail;
+  }
+  for (i = 0; i < sizeof(ops) / sizeof(ops[0]); i++)
+  {
+    if (ops[i] > probe->last_op ||
+        !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+    {
+      free(probe);
+      errno = ENOSYS;
+      goto fail;
+    }
+  }
+  free(probe);
+
+  /* with IORING_FEAT_SINGLE_MMAP both rings are in one mapping */
+  size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cqsize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (cqsize > size)
+    size = cqsize;
+  sq = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            uring.fd, IORING_OFF_SQ_RING);
+  if (sq == MAP_FAILED)
+    goto fail;
+  uring.sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    uring.fd, IORING_OFF_SQES);
+  if (uring.sqes == MAP_FAILED)
+    goto fail;
+
+  uring.sq_head = (unsigned *) (sq + params.sq_off.head);
+  uring.sq_tail = (unsigned *) (sq + params.sq_off.tail);
+  uring.sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+  uring.sq_array = (unsigned *) (sq + params.sq_off.array);
+  uring.sq_entries = params.sq_entries;
+  uring.cq_head = (unsigned *) (sq + params.cq_off.head);
+  uring.cq_tail = (unsigned *) (sq + params.cq_off.tail);
+  uring.cq_mask = (unsigned *) (sq + params.cq_off.ring_mask);
+  uring.cqes = (struct io_uring_cqe *) (sq + params.cq_off.cqes);
+  return 0;
+
+fail:
+  i = errno;
+  close(uring.fd);
+  uring.fd = -1;
+  errno = i;
+  return -1;
+}
+
+/* submit what was queued and, if wait is set, sleep until at least one
+ * completion is there */
+int
+uring_enter(int wait)
+{
+  int n;
+
+  n = syscall(__NR_io_uring_enter, uring.fd, uring.queued, wait ? 1 : 0,
+              wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+  if (n > 0)
+    uring.queued -= n;
+  return n;
+}
+
+/* Make room for n entries, handing what is queued to the kernel if
+ * needed. The kernel ends a link at the end of a submission, so the
+ * entries of one link have to be reserved together before queueing the
+ * first of them. */
+void
+uring_reserve(unsigned n)
+{
+  unsigned tail = *uring.sq_tail;
+
+  if (tail - __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE) + n <=
+      uring.sq_entries)
+    return;
+  if (uring_enter(0) < 0 && errno != EINTR && errno != EAGAIN &&
+      errno != EBUSY)
+  {
+    perror("io_uring_enter");
+    exit(1);
+  }
+  if (tail - __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE) + n >
+      uring.sq_entries)
+  {
+    fprintf(stderr, "io_uring submission queue stuck\n");
+    exit(1);
+  }
+}
+
+/* Queue one operation. Nothing reaches the kernel before the next
+ * uring_enter(), so all pairs share that one system call. */
+struct io_uring_sqe *
+uring_queue(int op, int fd, unsigned long long user_data, unsigned int flags)
+{
+  struct io_uring_sqe *sqe;
+  unsigned tail;
+  unsigned index;
+
+  /* a no-op for the entries of a link, reserved up front */
+  uring_reserve(1);
+  tail = *uring.sq_tail;
+  index = tail & *uring.sq_mask;
+  sqe = &uring.sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = op;
+  sqe->fd = fd;
+  sqe->flags = flags;
+  sqe->user_data = user_data;
+  uring.sq_array[index] = index;
+  __atomic_store_n(uring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+  uring.queued++;
+  return sqe;
+}
+
+unsigned long long
+uring_data(struct port *port, int what)
+{
+  return (uintptr_t) port | what;
+}
+
+void
+uring_cancel(struct port *port, int what)
+{
+  struct io_uring_sqe *sqe;
+
+  sqe = uring_queue(IORING_OP_ASYNC_CANCEL, -1, UD_CANCEL, 0);
+  sqe->addr = uring_data(port, what);
+}
+
+void
+uring_cancel_write(struct port *from)
+{
+  if (from->wr_cancel)
+    return;
+  uring_cancel(from, UD_WRITE);
+  uring_cancel(from, UD_WPOLL);
+  from->wr_cancel = 1;
+}
+
+/* read into the free part of the ring up to where it wraps */
+void
+uring_read(struct port *from)
+{
+  struct io_uring_sqe *sqe;
+  struct ring *ring = &from->ring;
+  size_t tail = (ring->head + ring->len) % ring->size;
+  size_t len = ring->size - tail;
+
+  if (len > ring_space(ring))
+    len = ring_space(ring);
+  if (from->rd_poll)
+  {
+    sqe = uring_queue(IORING_OP_POLL_ADD, from->fd,
+                      uring_data(from, UD_RPOLL), IOSQE_IO_LINK);
+    sqe->poll32_events = POLLIN;
+  }
+  sqe = uring_queue(IORING_OP_READ, from->fd, uring_data(from, UD_READ), 0);
+  sqe->addr = (uintptr_t) (ring->buf + tail);
+  sqe->len = len;
+  from->rd_busy = 1;
+}
+
+/* write the stored part of the ring up to where it wraps; with link set
+ * the read queued next only starts once all of it went out */
+void
+uring_write(struct port *from, int link)
+{
+  struct io_uring_sqe *sqe;
+  struct ring *ring = &from->ring;
+  size_t len = ring->size - ring->head;
+
+  if (len > ring->len)
+    len = ring->len;
+  if (from->wr_poll)
+  {
+    sqe = uring_queue(IORING_OP_POLL_ADD, from->peer->fd,
+                      uring_data(from, UD_WPOLL), IOSQE_IO_LINK);
+    sqe->poll32_events = POLLOUT;
+  }
+  sqe = uring_queue(IORING_OP_WRITE, from->peer->fd,
+                    uring_data(from, UD_WRITE), link ? IOSQE_IO_LINK : 0);
+  sqe->addr = (uintptr_t) (ring->buf + ring->head);
+  sqe->len = len;
+  from->wr_busy = 1;
+}
+
+/* The io_uring counterpart of port_update(): keep a read of the master
+ * queued while there is room and a write to the peer while data waits.
+ * When both are needed the write goes first with the read linked behind
+ * it, the buffer is drained before it is refilled. */
+void
+uring_update(struct port *from)
+{
+  int can_read;
+
+  /* the pair was deleted, only waiting for what was cancelled */
+  if (from->fd < 0)
+    return;
+
+  /* nobody is listening on the other side, the data goes nowhere */
+  if (from->peer->state == PORT_HUNGUP && from->ring.len > 0)
+    relay_discard(from);
+
+  can_read = !from->rd_busy && from->state != PORT_HUNGUP &&
+    ring_space(&from->ring) > 0;
+  if (!from->wr_busy && from->ring.len > 0 &&
+      from->peer->state != PORT_HUNGUP)
+  {
+    /* the write, the read linked to it and the polls in front of them
+     * go to the kernel in one submission */
+    uring_reserve(1 + from->wr_poll + (can_read ? 1 + from->rd_poll : 0));
+    uring_write(from, can_read);
+    if (can_read)
+      uring_read(from);
+  }
+  else if (can_read)
+  {
+    uring_reserve(1 + from->rd_poll);
+    uring_read(from);
+  }
+}
+
+void
+uring_read_done(struct port *from, int res)
+{
+  from->rd_busy = 0;
+  if (from->fd < 0)
+    return;
+
+  if (res != -ECANCELED)
+    stat_add(from->reads, 1);
+  if (res > 0)
+  {
+    from->ring.len += res;
+    if (from->state != PORT_OPEN)
+      port_opened(from);
+  }
+  else if (res == -EAGAIN)
+  {
+    stat_add(from->eagains, 1);
+    from->rd_poll = 1;
+  }
+  else if (res == -EIO || res == 0)
+  {
+    /* the slave is closed and everything it wrote has been read */
+    port_hangup(from);
+  }
+  else if (res != -ECANCELED && res != -EINTR)
+  {
+    fprintf(stderr, "read: %s\n", strerror(-res));
+    exit(1);
+  }
+  uring_update(from);
+  uring_update(from->peer);
+}
+
+void
+uring_write_done(struct port *from, int res)
+{
+  from->wr_busy = 0;
+  from->wr_cancel = 0;
+  if (from->fd < 0)
+    return;
+
+  if (res != -ECANCELED)
+    stat_add(from->writes, 1);
+  if (res > 0)
+  {
+    stat_add(from->bytes, res);
+    ring_drop(&from->ring, res);
+  }
+  else if (res == -EAGAIN)
+  {
+    stat_add(from->eagains, 1);
+    from->wr_poll = 1;
+  }
+  else if (res != -ECANCELED && res != -EINTR)
+  {
+    fprintf(stderr, "Write error, br=%d bw=%d\n", (int) from->ring.len, res);
+    relay_discard(from);
+  }
+  uring_update(from);
+}
+
+/* the control socket, its clients and inotify stay on the epoll set,
+ * which is itself polled through the ring */
+void
+uring_epoll(void)
+{
+  struct io_uring_sqe *sqe;
+  struct epoll_event events[MAX_EVENTS];
+  int i, n;
+
+  do
+  {
+    n = epoll_wait(epfd, events, MAX_EVENTS, 0);
+    for (i = 0; i < n; i++)
+    {
+      struct source *src = events[i].data.ptr;
+
+      src->handler(src, events[i].events);
+    }
+  }
+  while (n == MAX_EVENTS);
+
+  sqe = uring_queue(IORING_OP_POLL_ADD, epfd, UD_EPOLL, 0);
+  sqe->poll32_events = POLLIN;
+}
+
+void
+uring_complete(const struct io_uring_cqe *cqe)
+{
+  struct port *port = (struct port *) (uintptr_t) (cqe->user_data & ~UD_MASK);
+
+  switch (cqe->user_data & UD_MASK)
+  {
+  case UD_READ:
+    uring_read_done(port, cqe->res);
+    break;
+  case UD_WRITE:
+    uring_write_done(port, cqe->res);
+    break;
+  case UD_EPOLL:
+    uring_epoll();
+    break;
+  default:
+    /* polls in front of a read or write and cancellations: what they
+     * lead to completes on its own */
+    break;
+  }
+}
+
+/* Start relaying a pair through the ring. Every port gets its buffer now,
+ * the kernel reads into it directly. */
+void
+uring_attach(struct pair *pair)
+{
+  int i;
+
+  for (i = 0; i < 2; i++)
+  {
+    port_watch(&pair->port[i]);
+    if (ring_alloc(&pair->port[i].ring, ring_size) < 0)
+      exit(1);
+  }
+  uring_update(&pair->port[0]);
+  uring_update(&pair->port[1]);
+}
+
+/* cancel everything in flight for a port that is going away */
+void
+uring_detach(struct port *port)
+{
+  if (port->rd_busy)
+  {
+    uring_cancel(port, UD_RPOLL);
+    uring_cancel(port, UD_READ);
+  }
+  if (port->wr_busy)
+    uring_cancel_write(port);
+}
+
+/* Start relaying a pair, in the thread of the worker it was given to */
+void
+pair_attach(struct pair *pair)
+{
+  struct epoll_event ev;
+  int i;
+
+  if (backend == BACKEND_URING)
+  {
+    uring_attach(pair);
+    return;
+  }
+  for (i = 0; i < 2; i++)
+  {
+    struct port *port = &pair->port[i];
+
+    port_watch(port);
+    port->events = ev.events = EPOLLIN;
+    ev.data.ptr = &port->src;
+    if (epoll_ctl(pair->worker->epfd, EPOLL_CTL_ADD, port->fd, &ev) < 0)
+    {
+      perror("epoll_ctl");
+      exit(1);
+    }
+  }
+}
+
+/* Stop relaying a pair, in the thread of its worker. Events for its
+ * ports may still be waiting in the batch being handled, and io_uring
+ * operations until their cancellation completes, so the memory is only
+ * released by pairs_reap() once they are all done. */
+void
+pair_detach(struct pair *pair)
+{
+  struct worker *worker = pair->worker;
+
+  if (backend == BACKEND_URING)
+  {
+    uring_detach(&pair->port[0]);
+    uring_detach(&pair->port[1]);
+  }
+  port_free(&pair->port[0]);
+  port_free(&pair->port[1]);
+  pair->next = worker->zombies;
+  worker->zombies = pair;
+}
+
+int
+pair_busy(struct pair *pair)
+{
+  return pair->port[0].rd_busy || pair->port[0].wr_busy ||
+    pair->port[1].rd_busy || pair->port[1].wr_busy;
+}
+
+void
+pairs_reap(struct worker *worker)
+{
+  struct pair **pp = &worker->zombies;
+  struct pair *pair;
+
+  while ((pair = *pp) != NULL)
+  {
+    if (pair_busy(pair))
+    {
+      pp = &pair->next;
+      continue;
+    }
+    *pp = pair->next;
+    free(pair->port[0].ring.buf);
+    free(pair->port[1].ring.buf);
+    free(pair);
+  }
+}
+
+/* Main thread: queue work for a worker. The queue only fills up when
+ * thousands of pairs are created at once; the worker empties it as fast
+ * as it can add them to its epoll set. */
+void
+worker_send(struct worker *worker, int op, struct pair *pair)
+{
+  size_t tail = worker->tail;
+  uint64_t one = 1;
+
+  while (tail - __atomic_load_n(&worker->head, __ATOMIC_ACQUIRE) ==
+         WORK_QUEUE_SIZE)
+    sched_yield();
+  worker->queue[tail % WORK_QUEUE_SIZE].op = op;
+  worker->queue[tail % WORK_QUEUE_SIZE].pair = pair;
+  __atomic_store_n(&worker->tail, tail + 1, __ATOMIC_RELEASE);
+
+  if (write(worker->evfd, &one, sizeof(one)) < 0)
+    perror("eventfd");
+}
+
+/* worker: take what the main thread queued */
+void
+queue_handler(struct source *src, unsigned int events)
+{
+  struct worker *worker = container_of(src, struct worker, queue_src);
+  struct work *work;
+  uint64_t count;
+  size_t head, tail;
+
+  /* reset the eventfd first, so work queued from here on wakes us again */
+  if (read(worker->evfd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    perror("eventfd");
+
+  tail = __atomic_load_n(&worker->tail, __ATOMIC_ACQUIRE);
+  for (head = worker->head; head != tail; head++)
+  {
+    work = &worker->queue[head % WORK_QUEUE_SIZE];
+    if (work->op == WORK_ATTACH)
+      pair_attach(work->pair);
+    else
+      pair_detach(work->pair);
+    __atomic_store_n(&worker->head, head + 1, __ATOMIC_RELEASE);
+  }
+}
+
+/* give a new pair to the worker with the fewest */
+void
+pair_assign(struct pair *pair)
+{
+  struct worker *worker = &workers[0];
+  int i;
+
+  for (i = 1; i < nworkers; i++)
+    if (workers[i].npairs < worker->npairs)
+      worker = &workers[i];
+  worker->npairs++;
+  pair->worker = worker;
+
+  if (threaded)
+    worker_send(worker, WORK_ATTACH, pair);
+  else
+    pair_attach(pair);
+}
+
+struct pair *
+pair_create(const char *link1, const char *link2)
+{
+  struct pair *pair;
+  char master[PTS_NAME_MAX];
+  const char *links[2] = { link1, link2 };
+  int i;
+
+  pair = calloc(1, sizeof(*pair));
+  if (pair == NULL)
+  {
+    perror("calloc");
+    return NULL;
+  }
+  for (i = 0; i < 2; i++)
+  {
+    pair->port[i].fd = -1;
+    pair->port[i].wd = -1;
+    pair->port[i].tfd = -1;
+    pair->port[i].pipe[0] = pair->port[i].pipe[1] = -1;
+  }
+
+  for (i = 0; i < 2; i++)
+  {
+    struct port *port = &pair->port[i];
+
+    port->fd = ptym_open(master, port->slave, PTS_NAME_MAX);
+    if (port->fd < 0)
+    {
+      fprintf(stderr, "Cannot open pty master: %d\n", port->fd);
+      goto fail;
+    }
+    port->mode = relay_mode;
+    if (port->mode == RELAY_SPLICE && port_open_pipe(port) < 0)
+      goto fail;
+    port->src.handler = port_handler;
+    port->peer = &pair->port[!i];
+    port->pair = pair;
+  }
+
+  if (link1 != NULL && link2 != NULL)
+  {
+    for (i = 0; i < 2; i++)
+    {
+      if (port_link(&pair->port[i], links[i]) < 0)
+      {
+        fprintf(stderr, "Cannot create: %s\n", links[i]);
+        goto fail;
+      }
+    }
+  }
+
+  for (i = 0; i < 2; i++)
+  {
+    conf_ser(pair->port[i].fd);
+    if (pacing)
+      pace_init(&pair->port[i]);
+  }
+
+  pair_assign(pair);
+
+  /* announce the pair only once it is ready to be opened */
+  if (link1 != NULL && link2 != NULL)
+    printf("(%s) <=> (%s)\n", link1, link2);
+  else
+    printf("(%s) <=> (%s)\n", pair->port[0].slave, pair->port[1].slave);
+  fflush(stdout);
+
+  pair->next = pairs;
+  pairs = pair;
+  npairs++;
+
+  return pair;
+
+fail:
+  for (i = 0; i < 2; i++)
+  {
+    /* the first link may be made when the second one fails */
+    if (pair->port[i].link != NULL)
+      unlink_symlink(pair->port[i].link);
+    port_free(&pair->port[i]);
+  }
+  free(pair->port[0].ring.buf);
+  free(pair->port[1].ring.buf);
+  free(pair);
+  return NULL;
+}
+
+/* Take a pair out of the relay and remove its symlinks; its worker
+ * closes and frees the rest. */
+void
+pair_destroy(struct pair *pair)
+{
+  struct pair **pp;
+  int i;
+
+  for (pp = &pairs; *pp != pair; pp = &(*pp)->next)
+    ;
+  *pp = pair->next;
+  npairs--;
+  pair->worker->npairs--;
+
+  for (i = 0; i < 2; i++)
+    if (pair->port[i].link != NULL)
+      unlink_symlink(pair->port[i].link);
+
+  if (threaded)
+    worker_send(pair->worker, WORK_DETACH, pair);
+  else
+    pair_detach(pair);
+}
+
+int
+read_config(const char *path)
+{
+  char line[2 * PATH_MAX];
+  char *link1, *link2;
+  FILE *f;
+  int lineno = 0;
+
+  f = fopen(path, "r");
+  if (f == NULL)
+  {
+    perror(path);
+    return -1;
+  }
+
+  while (fgets(line, sizeof(line), f) != NULL)
+  {
+    lineno++;
+    link1 = strtok(line, " \t\r\n");
+    if (link1 == NULL || link1[0] == '#')
+      continue;
+    link2 = strtok(NULL, " \t\r\n");
+    if (link2 == NULL)
+    {
+      fprintf(stderr, "%s:%d: expected two names\n", path, lineno);
+      fclose(f);
+      return -1;
+    }
+    if (pair_create(link1, link2) == NULL)
+    {
+      fclose(f);
+      return -1;
+    }
+  }
+
+  fclose(f);
+  return 0;
+}
+
+/* One command from the control socket. Every reply ends with a line
+ * "ok" or one starting with "error:". */
+void
+ctl_command(char *line, FILE *f)
+{
+  struct pair *pair;
+  struct port *port;
+  char *cmd, *arg1, *arg2;
+
+  cmd = strtok(line, " \t\r");
+  arg1 = strtok(NULL, " \t\r");
+  arg2 = strtok(NULL, " \t\r");
+  if (cmd == NULL)
+    return;
+
+  if (strcmp(cmd, "stats") == 0)
+  {
+    print_stats(f);
+  }
+  else if (strcmp(cmd, "add") == 0)
+  {
+    if ((arg1 == NULL) != (arg2 == NULL))
+    {
+      fprintf(f, "error: add takes two names or none\n");
+      return;
+    }
+    pair = pair_create(arg1, arg2);
+    if (pair == NULL)
+    {
+      fprintf(f, "error: cannot create the pair\n");
+      return;
+    }
+    fprintf(f, "(%s) <=> (%s)\n", port_name(&pair->port[0]),
+            port_name(&pair->port[1]));
+  }
+  else if (strcmp(cmd, "del") == 0 || strcmp(cmd, "link") == 0)
+  {
+    port = arg1 != NULL ? port_find(arg1) : NULL;
+    if (port == NULL)
+    {
+      fprintf(f, "error: no port %s\n", arg1 != NULL ? arg1 : "given");
+      return;
+    }
+    if (cmd[0] == 'd')
+    {
+      pair_destroy(port->pair);
+    }
+    else if (arg2 == NULL || port_link(port, arg2) < 0)
+    {
+      fprintf(f, "error: cannot link %s to %s\n",
+              arg2 != NULL ? arg2 : "nothing", port->slave);
+      return;
+    }
+  }
+  else
+  {
+    fprintf(f, "error: unknown command %s\n", cmd);
+    return;
+  }
+  fprintf(f, "ok\n");
+}
+
+void
+client_free(struct client *client)
+{
+  close(client->fd);
+  free(client->out);
+  free(client);
+}
+
+/* Send queued replies as far as the socket takes them without blocking,
+ * the rest goes out on EPOLLOUT. A client that does not read its replies
+ * only costs memory, never holds up the relay. */
+int
+client_send(struct client *client)
+{
+  struct epoll_event ev;
+  ssize_t n;
+
+  while (client->outoff < client->outlen)
+  {
+    n = send(client->fd, client->out + client->outoff,
+             client->outlen - client->outoff, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && errno == EAGAIN)
+      break;
+    if (n <= 0)
+      return -1;
+    client->outoff += n;
+  }
+  if (client->outoff == client->outlen)
+  {
+    free(client->out);
+    client->out = NULL;
+    client->outlen = client->outoff = 0;
+    if (client->eof)
+      return -1;
+  }
+
+  ev.events = client->eof ? 0 : EPOLLIN;
+  if (client->out != NULL)
+    ev.events |= EPOLLOUT;
+  if (ev.events == client->events)
+    return 0;
+  ev.data.ptr = &client->src;
+  if (epoll_ctl(epfd, EPOLL_CTL_MOD, client->fd, &ev) < 0)
+    return -1;
+  client->events = ev.events;
+  return 0;
+}
+
+/* append to the replies waiting to be sent */
+int
+client_queue(struct client *client, const char *data, size_t len)
+{
+  char *out;
+
+  if (client->outoff > 0)
+  {
+    client->outlen -= client->outoff;
+    memmove(client->out, client->out + client->outoff, client->outlen);
+    client->outoff = 0;
+  }
+  out = realloc(client->out, client->outlen + len);
+  if (out == NULL)
+    return -1;
+  memcpy(out + client->outlen, data, len);
+  client->out = out;
+  client->outlen += len;
+  return 0;
+}
+
+void
+client_handler(struct source *src, unsigned int events)
+{
+  struct client *client = container_of(src, struct client, src);
+  char *reply = NULL;
+  size_t replylen = 0;
+  char *line, *nl;
+  ssize_t n;
+  FILE *f;
+
+  if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR)) || client->eof)
+  {
+    if (client_send(client) < 0)
+      client_free(client);
+    return;
+  }
+
+  n = read(client->fd, client->in + client->inlen,
+           sizeof(client->in) - client->inlen);
+  if (n < 0 && (errno == EAGAIN || errno == EINTR))
+    return;
+  if (n <= 0)
+  {
+    /* the client is done sending, finish the replies it is owed */
+    client->eof = 1;
+    if (client_send(client) < 0)
+      client_free(client);
+    return;
+  }
+  client->inlen += n;
+
+  f = open_memstream(&reply, &replylen);
+  if (f == NULL)
+  {
+    client_free(client);
+    return;
+  }
+  line = client->in;
+  while ((nl = memchr(line, '\n', client->in + client->inlen - line)) != NULL)
+  {
+    *nl = '\0';
+    ctl_command(line, f);
+    line = nl + 1;
+  }
+  client->inlen -= line - client->in;
+  memmove(client->in, line, client->inlen);
+  if (client->inlen == sizeof(client->in))
+  {
+    fprintf(f, "error: command too long\n");
+    client->inlen = 0;
+    client->eof = 1;
+  }
+  fclose(f);
+
+  if (client_queue(client, reply, replylen) < 0 || client_send(client) < 0)
+    client_free(client);
+  free(reply);
+}
+
+void
+ctl_handler(struct source *src, unsigned int events)
+{
+  struct epoll_event ev;
+  struct client *client;
+  int fd;
+
+  while ((fd = accept4(ctlfd, NULL, NULL,
+                       SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+  {
+    client = calloc(1, sizeof(*client));
+    if (client == NULL)
+    {
+      perror("calloc");
+      close(fd);
+      continue;
+    }
+    client->src.handler = client_handler;
+    client->fd = fd;
+    client->events = ev.events = EPOLLIN;
+    ev.data.ptr = &client->src;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+    {
+      perror("epoll_ctl");
+      client_free(client);
+    }
+  }
+}
+
+int
+ctl_open(const char *path)
+{
+  struct sockaddr_un addr;
+  struct epoll_event ev;
+  struct stat st;
+  mode_t mask;
+  int ret;
+
+  if (strlen(path) >= sizeof(addr.sun_path))
+  {
+    fprintf(stderr, "%s: name too long\n", path);
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  ctlfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (ctlfd < 0)
+  {
+    perror("socket");
+    return -1;
+  }
+  /* a socket left behind by an earlier run */
+  if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+    unlink(path);
+  /* the commands create and remove files as us: owner only */
+  mask = umask(0177);
+  ret = bind(ctlfd, (struct sockaddr *) &addr, sizeof(addr));
+  umask(mask);
+  if (ret < 0 || listen(ctlfd, 16) < 0)
+  {
+    perror(path);
+    return -1;
+  }
+
+  ctl_src.handler = ctl_handler;
+  ev.events = EPOLLIN;
+  ev.data.ptr = &ctl_src;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, ctlfd, &ev) < 0)
+  {
+    perror("epoll_ctl");
+    return -1;
+  }
+  return 0;
+}
+
+/* One io_uring_enter() per round submits the reads and writes of every
+ * pair and collects whatever completed meanwhile. */
+void
+uring_loop(void)
+{
+  struct worker *worker = &workers[0];
+  struct io_uring_sqe *sqe;
+  unsigned head;
+
+  sqe = uring_queue(IORING_OP_POLL_ADD, epfd, UD_EPOLL, 0);
+  sqe->poll32_events = POLLIN;
+
+  while (1)
+  {
+    if (uring_enter(1) < 0 && errno != EINTR && errno != EAGAIN &&
+        errno != EBUSY)
+    {
+      perror("io_uring_enter");
+      exit(1);
+    }
+    if (stats_requested)
+    {
+      stats_requested = 0;
+      print_stats(stderr);
+    }
+    head = *uring.cq_head;
+    while (head != __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE))
+    {
+      uring_complete(&uring.cqes[head & *uring.cq_mask]);
+      head++;
+      __atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+    }
+    pairs_reap(worker);
+  }
+}
+
+/* Run the events of one epoll set forever. worker is NULL for the main
+ * thread's own loop when workers run in threads; only the main thread
+ * prints the stats asked for with SIGUSR1, the others block it. */
+void
+event_loop(int fd, struct worker *worker)
+{
+  struct epoll_event events[MAX_EVENTS];
+  int i, n;
+
+  while(1)
+  {
+    n = epoll_wait(fd, events, MAX_EVENTS, -1);
+    if (n == -1)
+    {
+      if (errno != EINTR)
+      {
+        perror("epoll_wait");
+        exit(1);
+      }
+      n = 0;
+    }
+    if (stats_requested && (worker == NULL || !threaded))
+    {
+      stats_requested = 0;
+      print_stats(stderr);
+    }
+    for (i = 0; i < n; i++)
+    {
+      struct source *src = events[i].data.ptr;
+
+      src->handler(src, events[i].events);
+    }
+    if (worker != NULL)
+      pairs_reap(worker);
+  }
+}
+
+void *
+worker_thread(void *arg)
+{
+  struct worker *worker = arg;
+
+  event_loop(worker->epfd, worker);
+  return NULL;
+}
+
+/* Set up a worker's epoll set, its inotify instance and, when it gets a
+ * thread of its own, the eventfd its queue is signalled with. */
+int
+worker_init(struct worker *worker, int fd)
+{
+  struct epoll_event ev;
+
+  worker->epfd = fd;
+  worker->evfd = -1;
+  if (worker->epfd < 0)
+    worker->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (worker->epfd < 0)
+  {
+    perror("epoll_create1");
+    return -1;
+  }
+
+  /* without inotify a reopened slave is noticed when it first writes */
+  worker->inofd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (worker->inofd < 0)
+  {
+    perror("inotify_init1");
+  }
+  else
+  {
+    worker->inotify_src.handler = inotify_handler;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &worker->inotify_src;
+    if (epoll_ctl(worker->epfd, EPOLL_CTL_ADD, worker->inofd, &ev) < 0)
+    {
+      perror("epoll_ctl");
+      return -1;
+    }
+  }
+
+  if (!threaded)
+    return 0;
+
+  worker->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (worker->evfd < 0)
+  {
+    perror("eventfd");
+    return -1;
+  }
+  worker->queue_src.handler = queue_handler;
+  ev.events = EPOLLIN;
+  ev.data.ptr = &worker->queue_src;
+  if (epoll_ctl(worker->epfd, EPOLL_CTL_ADD, worker->evfd, &ev) < 0)
+  {
+    perror("epoll_ctl");
+    return -1;
+  }
+  return 0;
+}
+
+/* Start the worker threads with SIGUSR1 blocked, pinned to the CPUs the
+ * process may run on in turn if asked to. */
+int
+workers_start(void)
+{
+  pthread_attr_t attr;
+  sigset_t mask, old;
+  cpu_set_t allowed, cpu;
+  int ncpus, i, c, err;
+
+  sched_getaffinity(0, sizeof(allowed), &allowed);
+  ncpus = CPU_COUNT(&allowed);
+
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &mask, &old);
+
+  for (i = 0, c = -1; i < nworkers; i++)
+  {
+    pthread_attr_init(&attr);
+    if (pin && ncpus > 0)
+    {
+      /* the next allowed CPU after the one the last worker got */
+      do
+        c = (c + 1) % CPU_SETSIZE;
+      while (!CPU_ISSET(c, &allowed));
+      CPU_ZERO(&cpu);
+      CPU_SET(c, &cpu);
+      pthread_attr_setaffinity_np(&attr, sizeof(cpu), &cpu);
+    }
+    err = pthread_create(&workers[i].thread, &attr, worker_thread,
+                         &workers[i]);
+    pthread_attr_destroy(&attr);
+    if (err != 0)
+    {
+      fprintf(stderr, "pthread_create: %s\n", strerror(err));
+      return -1;
+    }
+  }
+
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  return 0;
+}
+
+int main(int argc, char* argv[])
+{
+  const char *config = NULL;
+  const char *ctl_path = NULL;
+  int count = 0;
+  int threads = -1;
+  int opt;
+  int i;
+
+  while ((opt = getopt(argc, argv, "pm:b:o:n:f:c:t:ae:h")) != -1)
+  {
+    switch (opt)
+    {
+    case 'p':
+      pacing = 1;
+      break;
+    case 'm':
+      if (strcmp(optarg, "copy") == 0)
+        relay_mode = RELAY_COPY;
+      else if (strcmp(optarg, "splice") == 0)
+        relay_mode = RELAY_SPLICE;
+      else
+      {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'b':
+      ring_size = strtoul(optarg, NULL, 0);
+      if (ring_size == 0)
+      {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'o':
+      if (strcmp(optarg, "block") == 0)
+        overflow = OVERFLOW_BLOCK;
+      else if (strcmp(optarg, "drop") == 0 ||
+               strcmp(optarg, "drop-oldest") == 0)
+        overflow = OVERFLOW_DROP;
+      else
+      {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'n':
+      count = atoi(optarg);
+      break;
+    case 'f':
+      config = optarg;
+      break;
+    case 'c':
+      ctl_path = optarg;
+      break;
+    case 't':
+      threads = atoi(optarg);
+      if (threads < 0)
+      {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'a':
+      pin = 1;
+      break;
+    case 'e':
+      if (strcmp(optarg, "epoll") == 0)
+        backend = BACKEND_EPOLL;
+      else if (strcmp(optarg, "uring") == 0 ||
+               strcmp(optarg, "io_uring") == 0)
+        backend = BACKEND_URING;
+      else
+      {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if ((argc - optind) % 2 != 0)
+  {
+    usage(argv[0]);
+    return 1;
+  }
+
+  /* packet mode puts a status byte in front of the data, which splice()
+   * would pass on to the peer */
+  if (pacing && relay_mode == RELAY_SPLICE)
+  {
+    fprintf(stderr, "pacing needs the copy relay, not using splice\n");
+    relay_mode = RELAY_COPY;
+  }
+
+  /* the io_uring relay copies through the ring, one thread, no pacing */
+  if (backend == BACKEND_URING)
+  {
+    const char *without = NULL;
+
+    if (pacing)
+      without = "pacing";
+    else if (relay_mode == RELAY_SPLICE)
+      without = "splice";
+    else if (overflow == OVERFLOW_DROP)
+      without = "-o drop";
+    else if (threads >= 0)
+      without = "threads";
+    if (without != NULL)
+    {
+      fprintf(stderr, "io_uring relay does without %s, using epoll\n",
+              without);
+      backend = BACKEND_EPOLL;
+    }
+  }
+
+  signal(SIGUSR1, request_stats);
+
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (epfd < 0)
+  {
+    perror("epoll_create1");
+    return 1;
+  }
+
+  /* without -t the main thread is the only worker */
+  if (threads >= 0)
+  {
+    threaded = 1;
+    nworkers = threads ? threads : sysconf(_SC_NPROCESSORS_ONLN);
+    if (nworkers < 1)
+      nworkers = 1;
+  }
+  workers = calloc(nworkers, sizeof(*workers));
+  if (workers == NULL)
+  {
+    perror("calloc");
+    return 1;
+  }
+  for (i = 0; i < nworkers; i++)
+  {
+    if (worker_init(&workers[i], threaded ? -1 : epfd) < 0)
+      return 1;
+  }
+  if (threaded && workers_start() < 0)
+    return 1;
+
+  /* a hung up port is only armed again when inotify sees it reopened */
+  if (backend == BACKEND_URING &&
+      (workers[0].inofd < 0 || uring_setup() < 0))
+  {
+    fprintf(stderr, "io_uring not available (%s), using epoll\n",
+            workers[0].inofd < 0 ? "no inotify" : strerror(errno));
+    backend = BACKEND_EPOLL;
+  }
+
+  if (ctl_path != NULL && ctl_open(ctl_path) < 0)
+    return 1;
+
+  for (i = optind; i < argc; i += 2)
+  {
+    if (pair_create(argv[i], argv[i + 1]) == NULL)
+      return 1;
+  }
+
+  if (config != NULL && read_config(config) < 0)
+    return 1;
+
+  for (i = 0; i < count; i++)
+  {
+    if (pair_create(NULL, NULL) == NULL)
+      return 1;
+  }
+
+  /* no pairs requested at all: behave as a single null modem */
+  if (npairs == 0 && pair_create(NULL, NULL) == NULL)
+    return 1;
+
+  if (backend == BACKEND_URING)
+    uring_loop();
+  else
+    event_loop(epfd, threaded ? NULL : &workers[0]);
 
   return EXIT_SUCCESS;
 }